@@ -0,0 +1,111 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+/* Microbenchmark of CompareBlocks() against the loop it replaced, which
+ * called memcmp() on the first block and each of the others in turn. Each
+ * group of files is compared when all of its blocks are identical, as they
+ * are for duplicates, and when each differs from the first at a random
+ * offset.
+ */
+
+#include "main.h"
+#include "blockcmp.h"
+#include <vector>
+
+static double Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int MemcmpBlocks(const char *block, const char *const *cands, int count, size_t len, int *result)
+{
+	int matching = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		result[i] = memcmp(block, cands[i], len);
+		if (!result[i])
+			matching++;
+	}
+	return matching;
+}
+
+/* Best time of a few runs, in seconds */
+static double Time(bool kernel, const std::vector<const char*> &blocks, size_t len, int reps)
+{
+	std::vector<int> result(blocks.size());
+	double best = 0;
+	for (int r = 0; r < 5; ++r)
+	{
+		double start = Now();
+		for (int i = 0; i < reps; ++i)
+		{
+			if (kernel)
+				CompareBlocks(blocks[0], &blocks[1], blocks.size() - 1, len, &result[0], NULL);
+			else
+				MemcmpBlocks(blocks[0], &blocks[1], blocks.size() - 1, len, &result[0]);
+		}
+		double t = Now() - start;
+		if (!r || t < best)
+			best = t;
+	}
+	return best / reps;
+}
+
+int main(int argc, char **argv)
+{
+	size_t len = (argc > 1) ? strtoul(argv[1], NULL, 0) : 65536;
+	if (len < 64)
+		len = 64;
+	
+	printf("CompareBlocks (%s) against memcmp, %lu byte blocks\n\n", CompareBlocksMethod(), (unsigned long)len);
+	printf("%6s  %-9s  %12s  %12s  %8s\n", "files", "blocks", "memcmp GB/s", "kernel GB/s", "speedup");
+	
+	srand(1);
+	for (int files = 8; files <= 256; files *= 2)
+	{
+		std::vector<char> data(files * len);
+		for (size_t i = 0; i < len; ++i)
+			data[i] = rand();
+		for (int f = 1; f < files; ++f)
+			memcpy(&data[f * len], &data[0], len);
+		
+		std::vector<const char*> blocks(files);
+		for (int f = 0; f < files; ++f)
+			blocks[f] = &data[f * len];
+		
+		for (int differ = 0; differ < 2; ++differ)
+		{
+			if (differ)
+			{
+				for (int f = 1; f < files; ++f)
+					data[f * len + rand() % len] ^= 1;
+			}
+			
+			/* Around 256MB compared by each run */
+			int reps = (256 << 20) / (files * len) + 1;
+			double tm = Time(false, blocks, len, reps), tk = Time(true, blocks, len, reps);
+			double bytes = (double)(files - 1) * len * (differ ? 0.5 : 1);
+			printf("%6d  %-9s  %12.2f  %12.2f  %7.2fx\n", files, differ ? "differing" : "identical", bytes / tm / 1e9,
+			       bytes / tk / 1e9, tm / tk);
+		}
+	}
+	
+	return EXIT_SUCCESS;
+}
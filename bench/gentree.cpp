@@ -0,0 +1,277 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+/* Builds synthetic trees for benchmarking, each exercising one part of
+ * fastdup. The contents are generated from a fixed seed, so the same
+ * scenario and scale always produce the same tree.
+ *
+ *   tiny       millions of tiny files, many of them duplicates
+ *   deep       long chains of nested directories
+ *   samesize   a huge group of files of the same size, mostly different
+ *   neardup    large files which differ only in their last byte
+ *   hardlinks  files with several hardlinks each
+ *   symlinks   a farm of symbolic links into the tree
+ */
+
+#include "main.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <vector>
+#include <string>
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*; quick, and the same everywhere */
+static unsigned long long Random()
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static void Fill(std::vector<char> &buf)
+{
+	for (size_t i = 0; i < buf.size(); i += 8)
+	{
+		unsigned long long v = Random();
+		memcpy(&buf[i], &v, (buf.size() - i < 8) ? buf.size() - i : 8);
+	}
+}
+
+static void MakeDir(const std::string &path)
+{
+	if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Unable to create directory '%s': %s\n", path.c_str(), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void WriteFile(const std::string &path, const char *data, size_t len)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, data, len) != (ssize_t)len || close(fd) < 0)
+	{
+		fprintf(stderr, "Unable to write file '%s': %s\n", path.c_str(), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static std::string Name(const char *prefix, unsigned long n)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s%06lu", prefix, n);
+	return buf;
+}
+
+/* Files of 1 to 64 bytes, a thousand to a directory; each has one of a few
+ * thousand contents, so most sizes hold many duplicates */
+static void GenTiny(const std::string &root, double scale)
+{
+	unsigned long count = 1000000 * scale;
+	std::vector<std::vector<char> > pool(4096);
+	for (size_t i = 0; i < pool.size(); ++i)
+	{
+		pool[i].resize(1 + Random() % 64);
+		Fill(pool[i]);
+	}
+	
+	std::string dir;
+	for (unsigned long i = 0; i < count; ++i)
+	{
+		if (!(i % 1000))
+		{
+			dir = root + "/" + Name("d", i / 1000);
+			MakeDir(dir);
+		}
+		const std::vector<char> &data = pool[Random() % pool.size()];
+		WriteFile(dir + "/" + Name("f", i), &data[0], data.size());
+	}
+}
+
+/* Chains of 200 nested directories, with a file at each level; every chain
+ * holds the same files */
+static void GenDeep(const std::string &root, double scale)
+{
+	unsigned long chains = 50 * scale;
+	if (!chains)
+		chains = 1;
+	
+	std::vector<std::vector<char> > files(200, std::vector<char>(1024));
+	for (size_t i = 0; i < files.size(); ++i)
+		Fill(files[i]);
+	
+	for (unsigned long c = 0; c < chains; ++c)
+	{
+		std::string dir = root + "/" + Name("chain", c);
+		for (size_t level = 0; level < files.size(); ++level)
+		{
+			MakeDir(dir);
+			WriteFile(dir + "/data", &files[level][0], files[level].size());
+			dir += "/sub";
+		}
+	}
+}
+
+/* A single group of 4KB files; one in ten is a copy of one of a hundred
+ * files, and the rest are unique */
+static void GenSameSize(const std::string &root, double scale)
+{
+	unsigned long count = 100000 * scale;
+	std::vector<std::vector<char> > masters(100, std::vector<char>(4096));
+	for (size_t i = 0; i < masters.size(); ++i)
+		Fill(masters[i]);
+	
+	std::vector<char> buf(4096);
+	std::string dir;
+	for (unsigned long i = 0; i < count; ++i)
+	{
+		if (!(i % 1000))
+		{
+			dir = root + "/" + Name("d", i / 1000);
+			MakeDir(dir);
+		}
+		if (!(Random() % 10))
+			buf = masters[Random() % masters.size()];
+		else
+			Fill(buf);
+		WriteFile(dir + "/" + Name("f", i), &buf[0], buf.size());
+	}
+}
+
+/* Eight large files that are identical up to their last byte, and two that
+ * are identical to the first of them */
+static void GenNearDup(const std::string &root, double scale)
+{
+	size_t size = 64 * 1048576 * scale;
+	if (size < 1048576)
+		size = 1048576;
+	
+	std::vector<char> buf(size);
+	Fill(buf);
+	for (int i = 0; i < 10; ++i)
+	{
+		if (i < 8)
+			buf[size - 1] = i;
+		else
+			buf[size - 1] = 0;
+		WriteFile(root + "/" + Name("big", i), &buf[0], size);
+	}
+}
+
+/* Files of 8KB, each with four hardlinks in other directories, and a copy
+ * of every tenth file */
+static void GenHardlinks(const std::string &root, double scale)
+{
+	unsigned long count = 10000 * scale;
+	for (int d = 0; d < 5; ++d)
+		MakeDir(root + "/" + Name("d", d));
+	
+	std::vector<char> buf(8192);
+	for (unsigned long i = 0; i < count; ++i)
+	{
+		Fill(buf);
+		std::string name = Name("f", i);
+		std::string first = root + "/d000000/" + name;
+		WriteFile(first, &buf[0], buf.size());
+		for (int d = 1; d < 5; ++d)
+		{
+			std::string path = root + "/" + Name("d", d) + "/" + name;
+			if (link(first.c_str(), path.c_str()) < 0)
+			{
+				fprintf(stderr, "Unable to create link '%s': %s\n", path.c_str(), strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (!(i % 10))
+			WriteFile(root + "/" + Name("copy", i), &buf[0], buf.size());
+	}
+}
+
+/* A thousand files, and twenty symbolic links to each of them; half point
+ * straight to the file, and half to another link */
+static void GenSymlinks(const std::string &root, double scale)
+{
+	unsigned long count = 1000 * scale;
+	if (!count)
+		count = 1;
+	MakeDir(root + "/data");
+	MakeDir(root + "/farm");
+	
+	std::vector<char> buf(2048);
+	for (unsigned long i = 0; i < count; ++i)
+	{
+		Fill(buf);
+		WriteFile(root + "/data/" + Name("f", i), &buf[0], buf.size());
+	}
+	
+	for (unsigned long i = 0; i < count * 20; ++i)
+	{
+		std::string target;
+		if (i < count || i % 2)
+			target = "../data/" + Name("f", i % count);
+		else
+			target = Name("l", i % count);
+		std::string path = root + "/farm/" + Name("l", i);
+		if (symlink(target.c_str(), path.c_str()) < 0)
+		{
+			fprintf(stderr, "Unable to create link '%s': %s\n", path.c_str(), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s tiny|deep|samesize|neardup|hardlinks|symlinks directory [scale]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	std::string scenario = argv[1], root = argv[2];
+	double scale = (argc > 3) ? strtod(argv[3], NULL) : 1;
+	if (scale <= 0)
+	{
+		fprintf(stderr, "Error: Invalid scale '%s'\n", argv[3]);
+		return EXIT_FAILURE;
+	}
+	
+	MakeDir(root);
+	if (scenario == "tiny")
+		GenTiny(root, scale);
+	else if (scenario == "deep")
+		GenDeep(root, scale);
+	else if (scenario == "samesize")
+		GenSameSize(root, scale);
+	else if (scenario == "neardup")
+		GenNearDup(root, scale);
+	else if (scenario == "hardlinks")
+		GenHardlinks(root, scale);
+	else if (scenario == "symlinks")
+		GenSymlinks(root, scale);
+	else
+	{
+		fprintf(stderr, "Error: Unknown scenario '%s'\n", scenario.c_str());
+		return EXIT_FAILURE;
+	}
+	
+	return EXIT_SUCCESS;
+}
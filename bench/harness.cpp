@@ -0,0 +1,283 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+/* Runs fastdup on a set of trees, and measures each run: the time taken
+ * to scan and to compare, the bytes and syscalls it read with, and its
+ * peak memory use. Each tree is run with a hot cache, and with a cold one
+ * when the page cache can be dropped (which needs root). Results are
+ * written as one JSON object per line, and summarized on stderr.
+ */
+
+#include "main.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+struct RunResult
+{
+	double wall, scan, compare;
+	double user, sys;
+	/* Bytes read through syscalls, and from storage */
+	unsigned long long rchar, readbytes;
+	unsigned long long syscr;
+	/* Peak resident size, in KB */
+	long maxrss;
+	int status;
+};
+
+static double Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool DropCaches()
+{
+	sync();
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return false;
+	bool ok = (write(fd, "3\n", 2) == 2);
+	close(fd);
+	return ok;
+}
+
+/* I/O counters of a process, which must not have been reaped yet */
+static void ReadIo(pid_t pid, RunResult &r)
+{
+	char path[64], line[256];
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return;
+	
+	while (fgets(line, sizeof(line), f))
+	{
+		unsigned long long v;
+		if (sscanf(line, "rchar: %llu", &v) == 1)
+			r.rchar = v;
+		else if (sscanf(line, "syscr: %llu", &v) == 1)
+			r.syscr = v;
+		else if (sscanf(line, "read_bytes: %llu", &v) == 1)
+			r.readbytes = v;
+	}
+	fclose(f);
+}
+
+/* Run fastdup once. The scan is taken to end when fastdup says it is
+ * comparing, which it does as soon as the scan is done. */
+static bool Run(const std::vector<std::string> &cmd, RunResult &r)
+{
+	memset(&r, 0, sizeof(r));
+	
+	int out[2];
+	if (pipe(out) < 0)
+		return false;
+	
+	std::vector<char*> argv;
+	for (std::vector<std::string>::const_iterator it = cmd.begin(); it != cmd.end(); ++it)
+		argv.push_back(const_cast<char*>(it->c_str()));
+	argv.push_back(NULL);
+	
+	double start = Now();
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (!pid)
+	{
+		int null = open("/dev/null", O_WRONLY);
+		dup2(out[1], 1);
+		dup2(null, 2);
+		close(out[0]);
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+	
+	close(out[1]);
+	FILE *f = fdopen(out[0], "r");
+	char line[4096];
+	r.scan = -1;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (r.scan < 0 && !strncmp(line, "Comparing ", 10))
+			r.scan = Now() - start;
+	}
+	fclose(f);
+	
+	siginfo_t info;
+	waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+	r.wall = Now() - start;
+	ReadIo(pid, r);
+	
+	struct rusage ru;
+	wait4(pid, &r.status, 0, &ru);
+	r.user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	r.sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	r.maxrss = ru.ru_maxrss;
+	
+	if (r.scan < 0)
+		r.scan = r.wall;
+	r.compare = r.wall - r.scan;
+	return true;
+}
+
+static bool WallLess(const RunResult &a, const RunResult &b)
+{
+	return a.wall < b.wall;
+}
+
+static void ShowHelp(const char *bin)
+{
+	printf(
+		"Usage: %s [options] fastdup directory [directory..]\n"
+		"Options:\n"
+		"    -r runs                     Runs of each tree with each cache state (default 3)\n"
+		"    -o file                     Append results to file as JSON lines (default stdout)\n"
+		"    -a options                  Options to pass to fastdup, as one argument\n"
+		"    -H                          Only run with a hot cache\n"
+		"\n", bin
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = 3;
+	const char *outfile = NULL;
+	std::vector<std::string> extra;
+	bool cold = true;
+	
+	int opt;
+	while ((opt = getopt(argc, argv, "r:o:a:Hh")) >= 0)
+	{
+		switch (opt)
+		{
+			case 'r':
+				runs = atoi(optarg);
+				if (runs < 1)
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -r\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'a':
+			{
+				char *copy = strdup(optarg), *save = NULL;
+				for (char *tok = strtok_r(copy, " ", &save); tok; tok = strtok_r(NULL, " ", &save))
+					extra.push_back(tok);
+				free(copy);
+				break;
+			}
+			case 'H':
+				cold = false;
+				break;
+			default:
+				ShowHelp(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	
+	if (argc - optind < 2)
+	{
+		ShowHelp(argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	FILE *out = stdout;
+	if (outfile && !(out = fopen(outfile, "a")))
+	{
+		fprintf(stderr, "Unable to open '%s': %s\n", outfile, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	
+	const char *fastdup = argv[optind];
+	if (cold && !DropCaches())
+	{
+		fprintf(stderr, "Unable to drop the page cache (%s); only running with a hot cache\n", strerror(errno));
+		cold = false;
+	}
+	
+	fprintf(stderr, "%-12s %-5s %9s %9s %9s %12s %10s %10s\n", "tree", "cache", "wall s", "scan s", "compare s",
+	        "read MB", "syscalls", "rss MB");
+	
+	for (int t = optind + 1; t < argc; ++t)
+	{
+		std::vector<std::string> cmd;
+		cmd.push_back(fastdup);
+		cmd.push_back("-b");
+		cmd.insert(cmd.end(), extra.begin(), extra.end());
+		cmd.push_back(argv[t]);
+		
+		const char *name = strrchr(argv[t], '/') ? strrchr(argv[t], '/') + 1 : argv[t];
+		
+		for (int c = cold ? 0 : 1; c < 2; ++c)
+		{
+			const char *cache = c ? "hot" : "cold";
+			std::vector<RunResult> results;
+			
+			/* Warm the cache before hot runs */
+			RunResult r;
+			if (c && !Run(cmd, r))
+			{
+				fprintf(stderr, "Unable to run '%s': %s\n", fastdup, strerror(errno));
+				return EXIT_FAILURE;
+			}
+			
+			for (int i = 0; i < runs; ++i)
+			{
+				if (!c)
+					DropCaches();
+				if (!Run(cmd, r))
+				{
+					fprintf(stderr, "Unable to run '%s': %s\n", fastdup, strerror(errno));
+					return EXIT_FAILURE;
+				}
+				if (!WIFEXITED(r.status) || WEXITSTATUS(r.status))
+				{
+					fprintf(stderr, "fastdup failed on '%s'\n", argv[t]);
+					return EXIT_FAILURE;
+				}
+				results.push_back(r);
+				
+				fprintf(out, "{\"tree\":\"%s\",\"path\":\"%s\",\"cache\":\"%s\",\"run\":%d,\"wall_s\":%.6f,"
+				        "\"scan_s\":%.6f,\"compare_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,\"rchar\":%llu,"
+				        "\"read_bytes\":%llu,\"read_syscalls\":%llu,\"maxrss_kb\":%ld}\n", name, argv[t], cache, i,
+				        r.wall, r.scan, r.compare, r.user, r.sys, r.rchar, r.readbytes, r.syscr, r.maxrss);
+				fflush(out);
+			}
+			
+			/* Summarize with the median run */
+			std::sort(results.begin(), results.end(), WallLess);
+			const RunResult &m = results[results.size() / 2];
+			fprintf(stderr, "%-12s %-5s %9.3f %9.3f %9.3f %12.1f %10llu %10.1f\n", name, cache, m.wall, m.scan, m.compare,
+			        m.rchar / 1048576.0, m.syscr, m.maxrss / 1024.0);
+		}
+	}
+	
+	if (out != stdout)
+		fclose(out);
+	return EXIT_SUCCESS;
+}
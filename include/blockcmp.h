@@ -0,0 +1,44 @@
+#ifndef BLOCKCMP_H
+#define BLOCKCMP_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <sys/types.h>
+
+/* Compare a block with each of count others of the same length, as memcmp()
+ * would, in a single pass over the block: it is compared a piece at a time
+ * with every candidate that still matches, so that it is read from memory
+ * once rather than once for every candidate. Candidates are dropped as soon
+ * as they differ. That only pays off while the blocks stay in the cache;
+ * with more candidates than that, each is compared whole in turn, as
+ * memcmp() would.
+ *
+ * For each candidate, result is 0 if it matches, or less or greater than 0
+ * if the block is less or greater than it. If offset is not NULL, it is set
+ * to the offset of the first difference, or len if there is none. Returns
+ * the number of candidates that match.
+ *
+ * SSE2, AVX2 or AVX-512 is used, whichever is the best the CPU supports.
+ */
+int CompareBlocks(const char *block, const char *const *cands, int count, size_t len, int *result, size_t *offset);
+
+/* Name of the instruction set CompareBlocks() uses */
+const char *CompareBlocksMethod();
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <sys/types.h>
+#include <pthread.h>
+
+class FileReference;
+
+/* Content hashes are chained over units of this many bytes, so that a hash
+ * up to an offset doesn't depend on the size of the blocks it was read in */
+#define CACHE_UNIT 4096
+/* Number of prefilter samples kept for each file */
+#define CACHE_SAMPLES 3
+
+/* Persistent cache of what earlier runs learned about files, so that files
+ * which haven't changed since don't have to be read again to be told apart.
+ * Entries are keyed by device and inode, and are only used while the size,
+ * modification time and change time of the file are the same as when the
+ * entry was made.
+ *
+ * Two things are kept for each file: the hashes of the samples read by the
+ * prefilter, and hashes of the content of the file up to each offset where
+ * Compare split it from other files, which includes the end of the file for
+ * files that were read in full. Two files with different hashes up to the
+ * same offset are certainly different, and are split without being read.
+ * Equal hashes prove nothing; those files are compared as usual, so the
+ * cache can never cause files to be reported as duplicates.
+ *
+ * The file is a header, an array of fixed-size records sorted by device and
+ * inode, and an array of the content hashes they refer to. It is mapped and
+ * searched in place, so loading it only costs the pages that are looked at.
+ * Entries learned in this run are kept aside, and merged with the old ones
+ * into a new file which then replaces the old one. Old entries are dropped
+ * once their file is seen to have changed, or when no run has used them
+ * for CACHE_MAX_AGE, so that the file doesn't keep every file it ever saw.
+ */
+class CompareCache
+{
+ public:
+	/* Hash of the content of a file from its start up to offset */
+	struct Snapshot
+	{
+		unsigned long long offset, hash;
+	};
+
+ private:
+	struct Header;
+	struct Record
+	{
+		unsigned long long dev, ino, size, mtime, ctime;
+		unsigned long long samples[CACHE_SAMPLES];
+		/* Bit n is set if samples[n] is known */
+		unsigned flags;
+		unsigned nsnaps;
+		/* Index of the first snapshot of this file */
+		unsigned long long snapidx;
+		/* When a run last used this record, in seconds */
+		unsigned long long used;
+	};
+	struct Entry
+	{
+		Record rec;
+		std::vector<Snapshot> snaps;
+	};
+	typedef std::pair<unsigned long long, unsigned long long> Key;
+
+	/* The cache file as loaded */
+	void *map;
+	size_t maplen;
+	const Record *records;
+	unsigned long long nrecords;
+	const Snapshot *snapshots;
+	unsigned long long nsnapshots;
+	/* What this run found out about each loaded record */
+	std::vector<unsigned char> usage;
+
+	/* Entries made or changed in this run */
+	std::map<Key, Entry> updates;
+	pthread_mutex_t lock;
+
+	CompareCache(const CompareCache &);
+	CompareCache &operator=(const CompareCache &);
+
+	const Record *Find(FileReference *file, off_t size);
+	const Entry *FindUpdate(FileReference *file, off_t size) const;
+	Entry &Update(FileReference *file, off_t size);
+	void Write(FILE *f, int part, unsigned long long cutoff, unsigned long long now, unsigned long long *nrec,
+	           unsigned long long *nsnap);
+
+ public:
+	CompareCache();
+	~CompareCache();
+
+	/* Map the cache file at path. A missing or damaged file is treated as
+	 * an empty cache. */
+	void Load(const char *path);
+	/* Replace the cache file at path with the old entries and those from
+	 * this run. Files modified or changed at or after cutoff (in ns) are
+	 * left out, as a change soon after might not alter their times. Returns
+	 * false with errno set on failure. */
+	bool Save(const char *path, unsigned long long cutoff);
+
+	bool Sample(FileReference *file, off_t size, int sample, unsigned long long *hash);
+	void SetSample(FileReference *file, off_t size, int sample, unsigned long long hash);
+	/* Content hashes of a file, in order of offset */
+	void Snapshots(FileReference *file, off_t size, std::vector<Snapshot> &out);
+	void AddSnapshots(FileReference *file, off_t size, const std::vector<Snapshot> &snaps);
+
+	/* Continue the content hash h over the next len bytes of a file; len
+	 * must be a multiple of CACHE_UNIT, except at the end of the file */
+	static unsigned long long Chain(unsigned long long h, const char *data, size_t len);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Sorts filesystems into lanes by the disk they are stored on, so that each
+ * disk can be given threads of its own. Partitions of a disk share its lane,
+ * as does a mapped device (such as LVM) that is stored on a single disk.
+ * Anything else that isn't a block device, such as a network filesystem or
+ * a btrfs subvolume, gets a lane of its own.
+ */
+class DeviceMap
+{
+ private:
+	std::map<dev_t, unsigned> lanes;
+	/* Lane of each disk, by name */
+	std::map<std::string, unsigned> disks;
+	pthread_mutex_t lock;
+	
+	DeviceMap(const DeviceMap &);
+	DeviceMap &operator=(const DeviceMap &);
+	
+ public:
+	DeviceMap();
+	~DeviceMap();
+	
+	/* Lane of the disk that filesystem dev is stored on */
+	unsigned Lane(dev_t dev);
+	unsigned Count();
+};
+
+/* Add the path of every mounted filesystem to points */
+void MountPoints(std::vector<std::string> &points);
+
+/* Hands out items of work, by index, to threads that each take only the
+ * items of their own lane, in the order they were given */
+class LaneQueue
+{
+ private:
+	std::vector<std::vector<size_t> > items;
+	std::vector<long> next;
+	
+ public:
+	LaneQueue() { }
+	
+	/* Queue items 0 to lanes.size() - 1, each to the lane given for it */
+	void Assign(const std::vector<unsigned> &lanes);
+	unsigned Lanes() const { return items.size(); }
+	size_t Size(unsigned lane) const { return items[lane].size(); }
+	/* Take the next item of a lane; returns false once there are none */
+	bool Next(unsigned lane, size_t *item);
+};
+
+/* Passed to each thread started by RunLanes */
+struct LaneThread
+{
+	void *state;
+	unsigned lane;
+};
+
+/* Run up to depth threads for each lane of queue, as many as it has items,
+ * and wait for all of them to finish. One of them runs on the calling
+ * thread. Each thread is started with fn(LaneThread*). */
+void RunLanes(const LaneQueue &queue, unsigned depth, void *(*fn)(void*), void *state);
+
+#endif
@@ -22,15 +22,89 @@
 #include <vector>
 #include <string>
 #include <limits.h>
+#include "index.h"
+#include "device.h"
 
 class DirReference;
 class FileReference;
+class BlockReader;
+class CompareCache;
+struct ScanTask;
+
+/* A set of identical files found by Compare, held until it is reported */
+struct DupeSet
+{
+	std::vector<FileReference*> files;
+	/* True if these are hardlinks to the same file */
+	bool linked;
+	
+	DupeSet() : linked(false) { }
+};
+typedef std::vector<DupeSet> DupeSetList;
+
+/* How Compare reads the files */
+enum CompareEngine
+{
+	ENGINE_READ,
+	ENGINE_URING,
+	ENGINE_MMAP
+};
+
+/* How the files being compared are kept in the page cache */
+enum IoPolicy
+{
+	IO_CACHED,
+	/* Drop what is read from the cache once it has been read */
+	IO_DONTNEED,
+	/* Read around the cache with O_DIRECT, where the filesystem allows;
+	 * files elsewhere are read as with IO_DONTNEED */
+	IO_DIRECT
+};
 
 struct DupOptions
 {
 	off_t sz_min, sz_max, sz_eq;
+	/* Number of threads used to walk the directory trees */
+	unsigned threads;
+	/* Give each disk this many threads of its own to scan and compare with,
+	 * rather than sharing opt.threads between all of them; 0 to share */
+	unsigned devdepth;
+	/* Don't cross into other filesystems below each tree */
+	bool onefs;
+	/* Use io_uring to look up file metadata in batches, where available */
+	bool uring;
+	/* Report duplicate sets in order of file size; otherwise, sets are
+	 * reported as soon as they are found when comparing with threads */
+	bool ordered;
+	CompareEngine engine;
+	IoPolicy iopolicy;
+	/* Order groups and reads by where files are stored on disk */
+	bool physical;
+	/* Most files to keep open at once while comparing, shared between the
+	 * threads; 0 to derive it from the open file limit */
+	unsigned long fdlimit;
+	/* File to keep what was learned about files in, for later runs, or NULL */
+	const char *cachefile;
+	/* Discard the contents of the cache, rather than using them */
+	bool cachereset;
+	/* Keep every file found by the scan, including those of unique sizes,
+	 * as they may gain duplicates later */
+	bool watch;
+	/* Compare groups of more files than this by hashing each file whole;
+	 * 0 to always compare them in lock-step */
+	unsigned long hashmin;
+	/* Compare files with equal hashes byte by byte as well */
+	bool verify;
+	/* Have the filesystem compare candidates, and share the extents of
+	 * those that are the same */
+	bool dedupe;
 	
-	DupOptions() : sz_min(0), sz_max(0), sz_eq(0) { }
+	DupOptions()
+		: sz_min(0), sz_max(0), sz_eq(0), threads(1), devdepth(0), onefs(false), uring(false), ordered(true), engine(ENGINE_READ), iopolicy(IO_CACHED),
+		  physical(false), fdlimit(0), cachefile(NULL), cachereset(false), watch(false), hashmin(0), verify(false),
+		  dedupe(false)
+	{
+	}
 };
 
 class FastDup
@@ -41,19 +115,74 @@ class FastDup
 	
  private:
 	typedef std::map<off_t,FileReference*> SizeRefMap;
+	typedef std::vector<std::pair<off_t,FileReference*> > SizeGroupList;
 	
-	SizeRefMap FileSzMap;
+	FileIndex Files;
+	/* Lists of files of each size, from Files once scanning is done; these
+	 * are split further before comparing, so there may be more than one
+	 * group of each size */
+	SizeGroupList CompareGroups;
+	/* Cache of earlier runs, while comparing with opt.cachefile */
+	CompareCache *Cache;
+	/* Lanes of the disks files are on, with opt.devdepth */
+	DeviceMap Devices;
+	/* Number of threads comparing at once, which share the descriptor
+	 * budget, or 0 for opt.threads */
+	unsigned CompareThreads;
 	std::vector<std::string> DirList;
 	
 	/* scan.cpp */
-	void ScanDirectory(const char *basepath, int bplen, const char *name, ErrorCallback cberr);
+	struct ScanState;
+	struct ScanWorker;
+	void ScanTrees(ErrorCallback cberr);
+	bool InScannedTree(const char *path);
+	bool WantSize(off_t size) const;
+	bool FollowLink(char *lbuf, int lblen, const char *path, size_t pathlen, struct stat &st, char *errbuf,
+	                size_t errlen);
+	void ScanDirectory(ScanWorker *worker, const ScanTask &task);
+	bool ScanHere(ScanWorker *worker, const ScanTask &task, int dfd);
+	void ScanWorkerLoop(ScanWorker *worker);
+	static void *ScanThread(void *arg);
 	/* compare.cpp */
-	void Compare(FileReference *first, off_t filesize, DupeSetCallback callback);
+	void Compare(FileReference *first, off_t filesize, DupeSetList &results);
+	bool CompareFiles(FileReference **frmap, int fcount, off_t filesize, BlockReader *reader, DupeSetList &results);
+	void CompareHashed(FileReference **frmap, int fcount, off_t filesize, DupeSetList &results);
+	/* dedupe.cpp */
+	bool CompareDeduped(FileReference **frmap, int fcount, off_t filesize, DupeSetList &results);
+	
+	/* fastdup.cpp */
+	struct CompareState;
+	static void *CompareThread(void *arg);
+	void ReportSets(DupeSetList &results, off_t filesize, DupeSetCallback dupecb, DupeSetCallback linkcb);
+	void CompareGroupsThreaded(DupeSetCallback dupecb, DupeSetCallback linkcb);
+	void SortPhysical(SizeGroupList &groups);
+	unsigned AssignLanes(const SizeGroupList &groups, LaneQueue &queue);
+	
+	/* prefilter.cpp */
+	struct PrefilterState;
+	static void *PrefilterThread(void *arg);
+	void Prefilter(SizeGroupList &groups);
+	
+	/* watch.cpp */
+	struct WatchState;
+	static void *WatchThread(void *arg);
+	void WatchIndex(WatchState *state);
+	void WatchRemove(WatchState *state, const std::string &path);
+	void WatchAdd(WatchState *state, const std::string &path, const struct stat &st);
+	bool WatchLink(WatchState *state, const std::string &path, struct stat &st, bool report);
+	void WatchEntry(WatchState *state, const std::string &path, bool addfiles, dev_t rootdev);
+	void WatchTree(WatchState *state, const std::string &path, bool addfiles, dev_t rootdev, bool follow);
+	void WatchPath(WatchState *state, const std::string &path);
+	void WatchCompare(WatchState *state);
 	
  public:
 	DupOptions opt;
 	unsigned long FileCount, CandidateSetCount, DupeFileCount, DupeSetCount;
+	/* Sets of paths that are hardlinks to the same file */
+	unsigned long LinkFileCount, LinkSetCount;
 	off_t FileSizeTotal;
+	/* Bytes whose extents were shared between duplicates, with opt.dedupe */
+	volatile unsigned long long DedupeBytes;
 	
 	FastDup();
 	~FastDup();
@@ -61,72 +190,34 @@ class FastDup
 	/* fastdup.cpp */
 	void AddDirectoryTree(const char *path);
 	void DoScanning(ErrorCallback errcb);
-	unsigned long DoCompare(DupeSetCallback dupecb);
+	unsigned long DoCompare(DupeSetCallback dupecb, DupeSetCallback linkcb = NULL);
+	/* watch.cpp */
+	/* Scan and compare, then keep watching for changes to the files, and
+	 * report sets of duplicates as they appear. Only returns (false, with
+	 * errno set) if changes can't be watched. */
+	bool Watch(ErrorCallback errcb, DupeSetCallback dupecb, DupeSetCallback linkcb = NULL);
 	
 	void Cleanup();
 };
 
+/* A directory, as its name and the directory it is in. The root of each
+ * scanned tree has no parent, and its whole path as its name. Directories
+ * and their names are stored in a FileIndex, and last as long as it does.
+ */
 class DirReference
 {
- private:
-	unsigned refs;
  public:
-	char *path;
+	DirReference *parent;
+	const char *name;
 	
-	DirReference(char *v)
-		: refs(0), path(v)
+	DirReference(DirReference *p, const char *n)
+		: parent(p), name(n)
 	{
 	}
 	
-	DirReference(const char *base, int baselen, const char *seg)
-		: refs(0)
-	{
-		if (!seg)
-		{
-			path = new char[baselen + 2];
-			memcpy(path, base, baselen + 1);
-			
-			if (path[baselen - 1] != '/')
-			{
-				path[baselen++] = '/';
-				path[baselen] = 0;
-			}
-		}
-		else
-		{
-			int len = baselen + strlen(seg);
-			path = new char[len + 3];
-			
-			PathMerge(path, len + 3, base, seg);
-			if (path[len - 1] != '/')
-			{
-				path[len++] = '/';
-				path[len] = 0;
-			}
-		}
-	}
-	
-	~DirReference()
-	{
-		if (path)
-			delete []path;
-	}
-	
-	void AddRef()
-	{
-		++refs;
-	}
-	
-	void RemoveRef()
-	{
-		if (--refs < 1)
-			delete this;
-	}
-	
-	unsigned RefCount()
-	{
-		return refs;
-	}
+	/* Write the path of the directory, ending in '/', to buf. Returns the
+	 * length of the path. */
+	size_t Path(char *buf, size_t size) const;
 };
 
 class FileReference
@@ -137,38 +228,39 @@ class FileReference
 	}
  public:
 	DirReference *dir;
-	char *file;
+	/* Name of the file, owned by the FileIndex */
+	const char *file;
 	FileReference *next;
+	/* Identifies the inode, so that hardlinks can be recognized */
+	dev_t dev;
+	ino_t ino;
+	/* Modification and change times when scanned, in nanoseconds; only
+	 * looked up when using a cache */
+	unsigned long long mtime, ctime;
 	
-	FileReference(DirReference *dr, const char *fn)
-		: dir(dr), next(NULL)
-	{
-		dir->AddRef();
-		
-		int len = strlen(fn);
-		file = new char[len + 1];
-		memcpy(file, fn, len + 1);
-	}
-	
-	~FileReference()
+	FileReference(DirReference *dr, const char *fn, dev_t d, ino_t i, unsigned long long mt = 0, unsigned long long ct = 0)
+		: dir(dr), file(fn), next(NULL), dev(d), ino(i), mtime(mt), ctime(ct)
 	{
-		dir->RemoveRef();
-		delete []file;
 	}
 	
-	const char *FullPath()
+	/* Write the full path of the file to buf, which is returned; paths are
+	 * built on demand, as only files that are compared or reported need
+	 * them */
+	const char *Path(char *buf, size_t size) const
 	{
-		static char fnbuf[PATH_MAX];
-		PathMerge(fnbuf, sizeof(fnbuf), dir->path, file);
-		return fnbuf;
+		size_t len = dir->Path(buf, size);
+		if (strlcpy(buf + len, file, size - len) >= size - len)
+			throw std::runtime_error("Path too long for buffer");
+		return buf;
 	}
 
 	/** Requests that this file be deleted.
 	 */
 	void Unlink()
 	{
-		std::cout << "Unlinking " << this->FullPath() << std::endl;
-       //     unlink(this->FullPath());
+		char path[PATH_MAX];
+		std::cout << "Unlinking " << this->Path(path, sizeof(path)) << std::endl;
+       //     unlink(path);
 	}
 };
 
@@ -0,0 +1,51 @@
+#ifndef HASH_H
+#define HASH_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <sys/types.h>
+
+/* A fast 64-bit hash (MurmurHash64A, by Austin Appleby). This is not a
+ * cryptographic hash; it is only used to tell data apart quickly, where
+ * a collision costs nothing more than a later byte by byte comparison. */
+unsigned long long Hash64(const void *data, size_t len, unsigned long long seed = 0);
+
+/* A 128-bit hash (MurmurHash3 x64_128, also by Austin Appleby), fed a piece
+ * at a time, so that whole files can be hashed as they are read. Collisions
+ * are far too unlikely to happen by chance, but as with Hash64, they can be
+ * made deliberately. */
+class Hash128
+{
+ private:
+	unsigned long long h1, h2;
+	unsigned long long total;
+	/* Bytes left over from the last Update(), short of a whole block */
+	unsigned char tail[16];
+	size_t taillen;
+	
+	void Block(const unsigned char *p);
+	
+ public:
+	Hash128(unsigned long long seed = 0);
+	
+	void Update(const void *data, size_t len);
+	void Final(unsigned long long digest[2]);
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+class DirReference;
+class FileReference;
+
+/* Hands out memory from large blocks, which is only ever freed all at once;
+ * used for the names of files and directories, which are small, many, and
+ * live as long as the index does. */
+class Arena
+{
+ private:
+	std::vector<char*> blocks;
+	/* Bytes used in the last block */
+	size_t used;
+	
+	Arena(const Arena &);
+	Arena &operator=(const Arena &);
+	
+ public:
+	Arena();
+	~Arena();
+	
+	void *Alloc(size_t len, size_t align = 1);
+	const char *Store(const char *str);
+	/* Take over the memory of another arena */
+	void Merge(Arena &other);
+	void Clear();
+};
+
+/* Every file found by a scan. References are stored in large blocks rather
+ * than allocated one at a time, and are appended along with their sizes as
+ * they are found; once the scan is done, Group() sorts them by size and
+ * links the files of each size into a list. Files of a size no other file
+ * has are dropped then, and the rest are copied into new blocks, so that
+ * the memory of the dropped files is freed all at once. The names of files
+ * and directories are kept in an arena, and last until the index is cleared.
+ */
+class FileIndex
+{
+ private:
+	struct Entry
+	{
+		off_t size;
+		FileReference *file;
+	};
+	
+	/* Files appended since the last Group() */
+	std::vector<Entry> entries;
+	std::vector<char*> blocks;
+	/* References used in the last block */
+	size_t used;
+	/* Released references, to be reused */
+	std::vector<FileReference*> freed;
+	Arena names;
+	
+	FileIndex(const FileIndex &);
+	FileIndex &operator=(const FileIndex &);
+	
+	void SortBySize();
+	
+ public:
+	FileIndex();
+	~FileIndex();
+	
+	/* Create a directory below parent, or a root directory with its path as
+	 * the name if parent is NULL */
+	DirReference *AddDirectory(DirReference *parent, const char *name);
+	/* Create a reference, which is not added to the index; the name is not
+	 * copied, and must last as long as the reference */
+	FileReference *Alloc(DirReference *dir, const char *name, dev_t dev, ino_t ino, unsigned long long mtime,
+	                     unsigned long long ctime);
+	/* Create a reference with a copy of the name, and add it to the index
+	 * with its size */
+	FileReference *Add(off_t size, DirReference *dir, const char *name, dev_t dev, ino_t ino,
+	                   unsigned long long mtime, unsigned long long ctime);
+	/* Destroy a reference; its memory is reused for the next one */
+	void Release(FileReference *file);
+	
+	/* Take over the files of another index, which is left empty */
+	void Merge(FileIndex &other);
+	/* Append the lists of files of each size in the index to groups, in
+	 * order of size, and empty the index. Files of a unique size are
+	 * released, unless keepsingle is true. */
+	void Group(std::vector<std::pair<off_t, FileReference*> > &groups, bool keepsingle);
+	
+	/* Free the memory of every reference and directory; references still in
+	 * use must have been released first */
+	void Clear();
+};
+
+#endif
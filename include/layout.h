@@ -0,0 +1,65 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+class FileReference;
+
+/* Orders reads of files on one device: those whose location is known come
+ * first (0), by where they are; then the rest (1), by inode number */
+typedef std::pair<int, unsigned long long> PhysicalKey;
+
+/* Where the data of a file is stored on its device, as reported by the
+ * FIEMAP ioctl. Used to order reads so that a disk head sweeps across the
+ * device instead of seeking back and forth between files. Where FIEMAP is
+ * not supported, the inode number is used instead; most filesystems
+ * allocate data near the inode, so inode order is a rough stand-in for
+ * disk order. Inode numbers and device offsets can't be compared, so files
+ * that fall back to them are ordered after the rest.
+ */
+class FileLayout
+{
+ private:
+	struct Extent
+	{
+		unsigned long long logical, physical, length;
+	};
+	std::vector<Extent> extents;
+	unsigned long long fallback;
+
+ public:
+	FileLayout() : fallback(0) { }
+
+	/* Read the extents of an open file; ino is used if that fails. If
+	 * first is true, only the first extent is loaded. */
+	void Load(int fd, ino_t ino, bool first = false);
+
+	/* A key that can be used to order reads of the byte at offset against
+	 * other files on the same device */
+	PhysicalKey Physical(off_t offset) const;
+};
+
+/* Key of the start of a file on its device, for ordering */
+PhysicalKey PhysicalStart(FileReference *file);
+
+#endif
@@ -33,5 +33,8 @@
 #include "fastdup.h"
 
 extern bool Interactive;
+/* Where progress and totals are written; stderr when stdout is reserved for
+ * sets of duplicates in a machine-readable format */
+extern FILE *Messages;
 
 #endif
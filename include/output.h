@@ -0,0 +1,72 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <vector>
+#include <sys/types.h>
+
+class FileReference;
+
+enum OutputFormat
+{
+	/* Described for people to read, and to answer prompts about */
+	OUTPUT_TEXT,
+	/* A JSON object for each set, one per line */
+	OUTPUT_JSON,
+	/* Each path followed by a NUL, and each set by another NUL */
+	OUTPUT_NUL
+};
+
+/* Writes sets of files in a format for other programs to read. Each set is
+ * built in a buffer that is reused for every set, and written with a single
+ * write() as soon as it is complete, so that a reader sees whole sets as
+ * they are found, rather than when a stdio buffer happens to fill up.
+ *
+ * JSON strings have to be valid Unicode, while paths are only bytes. Bytes
+ * that are not part of valid UTF-8 are written as the lone surrogates
+ * U+DC80 to U+DCFF, as Python's "surrogateescape" does, so that the exact
+ * path can still be recovered.
+ */
+class SetWriter
+{
+ private:
+	int fd;
+	OutputFormat format;
+	std::vector<char> buf;
+	size_t len;
+	
+	SetWriter(const SetWriter &);
+	SetWriter &operator=(const SetWriter &);
+	
+	/* Make room for at least n more bytes, returning where they go */
+	char *Reserve(size_t n);
+	void Append(const char *s, size_t n);
+	void AppendString(const char *s);
+	
+ public:
+	SetWriter(int fd, OutputFormat format);
+	
+	/* Write a set of count files of filesize bytes each; linked sets are
+	 * hardlinks to the same file. Returns false with errno set if it could
+	 * not be written. */
+	bool Write(FileReference *files[], unsigned long count, off_t filesize, bool linked);
+};
+
+#endif
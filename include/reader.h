@@ -0,0 +1,288 @@
+#ifndef READER_H
+#define READER_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <vector>
+#include <list>
+#include <sys/types.h>
+#include "uring.h"
+#include "layout.h"
+#include "fastdup.h"
+
+class FileReference;
+struct DupOptions;
+
+/* Alignment of O_DIRECT reads, in offset, length and memory */
+#define IO_ALIGN 4096
+
+inline size_t IoAlign(size_t len)
+{
+	return (len + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+}
+
+/* Open a file to be read for comparison, as policy asks */
+int OpenForCompare(const char *path, IoPolicy policy);
+/* Read len bytes at offset into buf, which must have room for len rounded
+ * up with IoAlign(), then drop them from the page cache if policy asks.
+ * Returns the number of bytes read, which is only less than len at the end
+ * of the file, or -1 with errno set. */
+ssize_t ReadForCompare(int fd, char *buf, size_t len, off_t offset, IoPolicy policy);
+
+/* Memory for blocks of file data, aligned for O_DIRECT. Large buffers are
+ * mapped, and backed by huge pages where the kernel allows, to save on TLB
+ * misses while comparing. Unlike a vector, the contents are not kept when
+ * it grows. */
+class IoBuffer
+{
+ private:
+	char *data;
+	size_t size;
+	bool mapped;
+
+	IoBuffer(const IoBuffer &);
+	IoBuffer &operator=(const IoBuffer &);
+
+	void Release();
+
+ public:
+	IoBuffer() : data(NULL), size(0), mapped(false) { }
+	~IoBuffer() { Release(); }
+
+	/* Make room for at least n bytes */
+	void Reserve(size_t n);
+	char *Data() const { return data; }
+	size_t Size() const { return size; }
+};
+
+/* Opens the files of a reader on demand, keeping no more than a budget of
+ * them open at once. Readers go through their files in turn, so closing the
+ * least recently used file would close every file just before it is needed;
+ * the most recently used file is closed instead, and the rest stay open.
+ * Files are read with pread(), so a file that is opened again just carries
+ * on at the right offset.
+ */
+class FdCache
+{
+ private:
+	FileReference **files;
+	std::vector<int> fds;
+	unsigned budget, open;
+	IoPolicy policy;
+	/* Open files, least recently used first */
+	std::list<int> used;
+	std::vector<std::list<int>::iterator> pos;
+
+	FdCache(const FdCache &);
+	FdCache &operator=(const FdCache &);
+
+ public:
+	FdCache(FileReference **files, int fcount, unsigned budget, IoPolicy policy);
+	~FdCache();
+
+	/* Descriptor of file i, opening it if necessary, or -1 with errno set
+	 * if it can't be opened */
+	int Get(int i);
+	void Close(int i);
+};
+
+/* Reads a set of same-sized files in lock-step, one block at a time, for
+ * Compare. Each call to Next() provides the next block of every file that
+ * has not been dropped; files are dropped once they have no possible
+ * matches left, and are not read any further.
+ */
+class BlockReader
+{
+ protected:
+	FileReference **files;
+	int fcount;
+	off_t filesize;
+	/* Offset of the next block to be returned by Next() */
+	off_t offset;
+	/* Data of the current block, for each file */
+	std::vector<const char*> data;
+	std::vector<bool> dropped;
+	/* Files that changed since they were scanned, or could not be opened,
+	 * and have been dropped */
+	std::vector<bool> failed;
+	FdCache fds;
+	IoPolicy policy;
+	/* Memory taken by the buffers of this reader */
+	size_t buffered;
+	/* The next hole in each file that ends after offset, or filesize for
+	 * both if there is none; and the bytes skipped as holes in all files */
+	std::vector<off_t> holestart, holeend;
+	off_t skipped;
+
+	BlockReader(FileReference **files, int fcount, off_t filesize, unsigned fdbudget, IoPolicy policy);
+
+	/* Descriptor of a file, opening it if necessary; a file that can't be
+	 * opened is failed, and -1 is returned */
+	int OpenFile(int i);
+	void ReadError(int i, int error);
+	/* Drop a file that no longer has the size it was scanned with */
+	void Fail(int i);
+	/* Length of the block at at, if it is len bytes or less */
+	size_t BlockLength(off_t at, size_t len) const;
+	/* Resize a buffer of file data, keeping count of the memory it takes */
+	void Resize(IoBuffer &buf, size_t size);
+	/* End of the range from offset from that is a hole in every file still
+	 * being read, as it reads as zeroes in all of them; from if there is
+	 * none. Skip() then moves offset past it, counting it as skipped. */
+	off_t HoleEnd(off_t from);
+	void Skip(off_t to);
+	void FindHole(int i, off_t from);
+
+ public:
+	virtual ~BlockReader();
+
+	/* Provide the next block of up to len bytes from every file. Returns
+	 * the length of the block, or 0 at the end of the files. Files that
+	 * turn out to be shorter than expected are dropped, and Failed(). */
+	virtual ssize_t Next(size_t len) = 0;
+	/* Stop reading a file */
+	virtual void Drop(int i) = 0;
+
+	const char *Data(int i) const { return data[i]; }
+	bool Failed(int i) const { return failed[i]; }
+	/* Offset just past the last block returned, and how much of the files
+	 * before it was skipped rather than read */
+	off_t Offset() const { return offset; }
+	off_t Skipped() const { return skipped; }
+	/* Preferred I/O size of the files, from the first that can be opened,
+	 * or 0 if none can */
+	size_t IoSize();
+	/* True if data returned by this reader may have been wrong, and the
+	 * comparison must be repeated with another reader */
+	virtual bool Unreliable() const { return false; }
+
+	/* Create the reader selected in opt for these files, for one of threads
+	 * comparing at once */
+	static BlockReader *Create(const DupOptions &opt, unsigned threads, FileReference **files, int fcount,
+	                           off_t filesize);
+	/* Number of files each of threads comparing at once may have open, or
+	 * of opt.threads if threads is 0 */
+	static unsigned FdBudget(const DupOptions &opt, unsigned threads);
+};
+
+/* Plain read() on each file in turn.
+ *
+ * When reading physically, files are read in the order their data is laid
+ * out on disk, and each is read in runs of many blocks at a time, so that a
+ * spinning disk spends its time transferring rather than seeking between
+ * files. The first run is a single block, as most files that differ do so
+ * near the start, and each run after that is twice as long as the last.
+ */
+class ReadBlockReader : public BlockReader
+{
+ private:
+	IoBuffer buf;
+	size_t bufsz;
+
+	bool physical;
+	std::vector<FileLayout> layouts;
+	/* The current run, which is read from every file at once */
+	off_t runoff;
+	size_t runlen, runfill, runmax;
+
+	void Refill(size_t len);
+
+ public:
+	ReadBlockReader(FileReference **files, int fcount, off_t filesize, unsigned fdbudget, IoPolicy policy,
+	                bool physical = false);
+	~ReadBlockReader();
+
+	ssize_t Next(size_t len);
+	void Drop(int i);
+};
+
+/* Maps the files into memory, so blocks are compared directly in the page
+ * cache without being copied. Files are unmapped as soon as they are
+ * dropped. A file that is truncated while mapped raises SIGBUS when the
+ * missing pages are touched; this is caught, and the file is failed, or
+ * if the fault happened outside of Next(), the reader becomes Unreliable().
+ * Files that can't be mapped are read with pread() instead.
+ */
+class MmapBlockReader : public BlockReader
+{
+ private:
+	std::vector<char*> maps;
+	IoBuffer buf;
+	size_t bufsz;
+	size_t maplen;
+	volatile bool unreliable;
+
+	bool Touch(const char *p, size_t len);
+
+ public:
+	MmapBlockReader(FileReference **files, int fcount, off_t filesize, unsigned fdbudget);
+	~MmapBlockReader();
+
+	ssize_t Next(size_t len);
+	void Drop(int i);
+	bool Unreliable() const { return unreliable; }
+
+	/* Called from the SIGBUS handler for a fault at addr */
+	bool Patch(void *addr);
+};
+
+#ifdef HAVE_IO_URING
+/* Reads through io_uring. The next block of every file is submitted as one
+ * batch as soon as the current block has arrived, so that the device is
+ * reading while the current block is compared. As the next block is read
+ * ahead, it has the length asked for by the previous call to Next(); when a
+ * call asks for more, the rest is read synchronously. Reads of dropped files
+ * are cancelled. Every file is kept open, so groups larger
+ * than the descriptor budget are read with ReadBlockReader instead.
+ */
+class UringBlockReader : public BlockReader
+{
+ private:
+	IoRing *ring;
+	/* Two sets of buffers; one holds the current block, while the next
+	 * block is read into the other */
+	IoBuffer buf[2];
+	int cur;
+	/* Length and offset of the reads in flight, and the distance between
+	 * the buffers of each file */
+	size_t pendlen, pendstride;
+	off_t pendoff;
+	bool submitted;
+	/* Result of the read in flight for each file, or pending */
+	std::vector<int> result;
+	std::vector<bool> inflight;
+	int waiting;
+
+	void Submit(size_t len);
+	void Complete(bool wait);
+	void Prep(int i);
+
+ public:
+	UringBlockReader(IoRing *ring, FileReference **files, int fcount, off_t filesize, IoPolicy policy);
+	~UringBlockReader();
+
+	ssize_t Next(size_t len);
+	void Drop(int i);
+
+	/* io_uring instance owned by the calling thread, or NULL if unavailable */
+	static IoRing *ThreadRing();
+};
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+class FastDup;
+
+/* Parts of a run, which are counted separately; the phase is set by the main
+ * thread before each part starts its threads */
+enum StatPhase
+{
+	PHASE_SCAN,
+	PHASE_PREFILTER,
+	PHASE_COMPARE,
+	PHASE_COUNT
+};
+
+enum StatCounter
+{
+	/* Directories opened, and calls to read their entries */
+	STAT_DIRS,
+	STAT_DIR_READS,
+	/* Metadata lookups, whether by a call or a request to io_uring */
+	STAT_STATS,
+	STAT_OPENS,
+	/* Read calls and requests, and the bytes of file data read or touched
+	 * through a mapping */
+	STAT_READS,
+	STAT_READ_BYTES,
+	/* Blocks compared with the first block of their class, and their bytes */
+	STAT_COMPARES,
+	STAT_COMPARE_BYTES,
+	/* Blocks sorted by a hash instead of being compared with every class */
+	STAT_HASH_SORTED,
+	/* Paths that were not compared, as hardlinks to one that was */
+	STAT_LINKED,
+	/* Files split apart by the prefilter, or by the cache before reading */
+	STAT_PREFILTERED,
+	STAT_CACHE_SPLITS,
+	/* Files no longer read as they were left alone in their class, and the
+	 * bytes of them that were not read because of it */
+	STAT_EARLY_OMITS,
+	STAT_OMITTED_BYTES,
+	/* Ranges that were holes in every file being compared, and their bytes,
+	 * which were skipped without reading */
+	STAT_HOLES,
+	STAT_HOLE_BYTES,
+	STAT_COUNT
+};
+
+/* Calls whose latency is recorded */
+enum StatLatency
+{
+	LAT_STAT,
+	LAT_OPEN,
+	LAT_READ,
+	LAT_COUNT
+};
+
+/* Counters of what a run spent its time on, kept by each thread for itself
+ * and added up when the thread exits, so that counting costs no more than
+ * an increment. Nothing is counted unless enabled is set. Latencies are kept
+ * in histograms with a bucket for each power of two of nanoseconds.
+ */
+class Stats
+{
+ private:
+	static void Add(StatCounter c, unsigned long long n);
+	static void Record(StatLatency l, unsigned long long start);
+	static unsigned long long Now();
+	
+ public:
+	static bool enabled;
+	
+	/* Start counting a new phase */
+	static void Phase(StatPhase phase);
+	
+	static void Count(StatCounter c, unsigned long long n = 1)
+	{
+		if (enabled)
+			Add(c, n);
+	}
+	
+	/* Time for Finish(), when a call starts */
+	static unsigned long long Start()
+	{
+		return enabled ? Now() : 0;
+	}
+	
+	/* Count a call of type l that began at start */
+	static void Finish(StatLatency l, unsigned long long start)
+	{
+		if (enabled)
+			Record(l, start);
+	}
+	
+	/* Note memory taken (or given back, if negative) for buffers of file
+	 * data, which is kept track of at its peak */
+	static void Buffer(long long delta);
+	
+	/* Write everything counted, along with the results of dup, as a JSON
+	 * document. Returns false with errno set on failure. */
+	static bool Write(const char *path, const FastDup &dup, double seconds);
+};
+
+/* System calls, counted in the current phase */
+int CountedOpen(const char *path, int flags);
+int CountedStat(const char *path, struct stat *st, bool follow = true);
+ssize_t CountedPread(int fd, void *buf, size_t len, off_t offset);
+
+#endif
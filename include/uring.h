@@ -0,0 +1,89 @@
+#ifndef URING_H
+#define URING_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING
+# endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Minimal io_uring wrapper, talking to the kernel directly so that we do
+ * not depend on liburing. A ring is not thread safe; each thread that
+ * wants to submit I/O should own its own ring.
+ *
+ * Usage is to fetch SQEs with one of the Prep functions (which return false
+ * if the submission queue is full), Submit() them, and then reap
+ * completions with Reap() until every submitted request has completed.
+ */
+class IoRing
+{
+ private:
+	int fd;
+	unsigned entries;
+
+	void *sqmap, *cqmap;
+	size_t sqmapsz, cqmapsz;
+	struct io_uring_sqe *sqes;
+
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+
+	/* Local copy of the submission tail, published to the kernel by Submit() */
+	unsigned sqlocal;
+	/* Number of requests submitted that have not been reaped */
+	unsigned inflight;
+
+	IoRing(const IoRing &);
+	IoRing &operator=(const IoRing &);
+
+	struct io_uring_sqe *GetSqe();
+
+ public:
+	/* Throws std::runtime_error if io_uring is not usable on this system */
+	IoRing(unsigned entries);
+	~IoRing();
+
+	unsigned Size() const { return entries; }
+	unsigned Inflight() const { return inflight; }
+
+	bool PrepStatx(int dfd, const char *path, int flags, unsigned mask, struct statx *buf, unsigned long long data);
+	bool PrepRead(int fd, void *buf, unsigned len, off_t offset, unsigned long long data);
+	bool PrepCancel(unsigned long long target, unsigned long long data);
+
+	/* Submit all prepared requests, and wait until at least wait of them
+	 * have completed. Returns false on error, with errno set. */
+	bool Submit(unsigned wait = 0);
+
+	/* Retrieve one completion, waiting for it if wait is true and requests
+	 * are still in flight. Returns false if no completion was available. */
+	bool Reap(unsigned long long *data, int *result, bool wait);
+};
+
+#endif
+
+#endif
@@ -38,6 +38,12 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 
 #include <sys/time.h>
 
+/* A file time from struct stat, in nanoseconds */
+inline unsigned long long StatTime(const struct timespec &ts)
+{
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 inline double SSTime()
 {
 	struct timeval tv;
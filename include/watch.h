@@ -0,0 +1,78 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include <vector>
+#include <map>
+#include <string>
+
+/* Reports paths below a set of directories that may have changed: files
+ * created, written, deleted or moved, and directories created, deleted or
+ * moved. Where the kernel allows it (which needs CAP_SYS_ADMIN), fanotify
+ * watches the whole filesystem of each directory; otherwise every directory
+ * is watched with inotify, and directories found later must be added with
+ * AddDirectory().
+ *
+ * Only paths are reported, and the caller looks at each path to see what is
+ * there now. A path that no longer exists may have been a file or a whole
+ * directory.
+ */
+class ChangeWatcher
+{
+ private:
+	int fd;
+	bool fanotify;
+	bool overflow;
+	/* inotify watches, by descriptor */
+	std::map<int, std::string> dirs;
+	/* For fanotify, a descriptor on each watched filesystem, by fsid, to
+	 * open the directories that events refer to */
+	std::vector<std::pair<std::pair<int, int>, int> > mounts;
+
+	ChangeWatcher(const ChangeWatcher &);
+	ChangeWatcher &operator=(const ChangeWatcher &);
+
+	bool StartFanotify(const std::vector<std::string> &trees);
+	void ReadFanotify(const char *buf, ssize_t len, std::vector<std::string> &paths);
+	void ReadInotify(const char *buf, ssize_t len, std::vector<std::string> &paths);
+
+ public:
+	ChangeWatcher();
+	~ChangeWatcher();
+
+	/* Start watching. Returns false with errno set if changes can't be
+	 * watched at all. */
+	bool Start(const std::vector<std::string> &trees);
+	/* True if directories must be added one by one */
+	bool NeedsDirectories() const { return !fanotify; }
+	/* Watch a directory, if NeedsDirectories(); returns false with errno
+	 * set on failure. path is only followed if it is a symbolic link and
+	 * follow is true; changes are reported by path either way. */
+	bool AddDirectory(const char *path, bool follow = false);
+
+	/* Wait up to timeout milliseconds (or forever, if negative) for changes,
+	 * and append the paths that changed. Returns false on error. */
+	bool Read(std::vector<std::string> &paths, int timeout);
+	/* True (once) if changes were lost, and everything must be looked at */
+	bool Overflowed();
+	const char *Method() const { return fanotify ? "fanotify" : "inotify"; }
+};
+
+#endif
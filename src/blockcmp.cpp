@@ -0,0 +1,221 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "blockcmp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD
+#endif
+
+/* Bytes of the block compared with every candidate at a time; small enough
+ * to stay in the L1 cache while the candidates are streamed past it */
+#define COMPARE_CHUNK 4096
+/* Beyond this many candidates, the blocks of a pass no longer fit in the
+ * cache, and the pass is bound by memory either way; streaming each block
+ * whole then does as well as memcmp() (measured with bench/blockcmp), where
+ * switching between hundreds of blocks a chunk at a time was slower */
+#define COMPARE_FANOUT 64
+
+/* Offset of the first byte that differs between a and b, or len */
+typedef size_t (*MismatchFunc)(const char *a, const char *b, size_t len);
+
+static size_t MismatchScalar(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long))
+	{
+		unsigned long wa, wb;
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb)
+			break;
+	}
+	for (; i < len; ++i)
+	{
+		if (a[i] != b[i])
+			return i;
+	}
+	return len;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Each of these compares four vectors at a time, and only looks for the
+ * byte that differs once a group of four doesn't match; AVX2 and AVX-512
+ * test the differences of all four at once, as memcmp() does */
+
+/* Always present on x86_64, but not on every 32-bit x86 CPU */
+__attribute__((target("sse2")))
+static size_t MismatchSse2(const char *a, const char *b, size_t len)
+{
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64)
+	{
+		__m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		__m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)),
+		                            _mm_loadu_si128((const __m128i*)(b + i + 16)));
+		__m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)),
+		                            _mm_loadu_si128((const __m128i*)(b + i + 32)));
+		__m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)),
+		                            _mm_loadu_si128((const __m128i*)(b + i + 48)));
+		__m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+		if (_mm_movemask_epi8(all) != 0xffff)
+			break;
+	}
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		unsigned mask = _mm_movemask_epi8(eq);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + MismatchScalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t MismatchAvx2(const char *a, const char *b, size_t len)
+{
+	/* Align loads from a, which is usually aligned the same as b */
+	size_t i = (32 - ((unsigned long)a & 31)) & 31;
+	if (i > len)
+		i = len;
+	size_t m = MismatchSse2(a, b, i);
+	if (m < i)
+		return m;
+	
+	for (; i + 128 <= len; i += 128)
+	{
+		__m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)),
+		                              _mm256_loadu_si256((const __m256i*)(b + i)));
+		__m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 32)),
+		                              _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+		__m256i d2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 64)),
+		                              _mm256_loadu_si256((const __m256i*)(b + i + 64)));
+		__m256i d3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 96)),
+		                              _mm256_loadu_si256((const __m256i*)(b + i + 96)));
+		__m256i any = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+		if (!_mm256_testz_si256(any, any))
+			break;
+	}
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+		                               _mm256_loadu_si256((const __m256i*)(b + i)));
+		unsigned mask = _mm256_movemask_epi8(eq);
+		if (mask != 0xffffffffU)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + MismatchSse2(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+static size_t MismatchAvx512(const char *a, const char *b, size_t len)
+{
+	size_t i = (64 - ((unsigned long)a & 63)) & 63;
+	if (i > len)
+		i = len;
+	size_t m = MismatchAvx2(a, b, i);
+	if (m < i)
+		return m;
+	
+	for (; i + 256 <= len; i += 256)
+	{
+		__m512i d0 = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		__m512i d1 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 64), _mm512_loadu_si512(b + i + 64));
+		__m512i d2 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 128), _mm512_loadu_si512(b + i + 128));
+		__m512i d3 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 192), _mm512_loadu_si512(b + i + 192));
+		__m512i any = _mm512_or_si512(_mm512_or_si512(d0, d1), _mm512_or_si512(d2, d3));
+		if (_mm512_test_epi64_mask(any, any))
+			break;
+	}
+	for (; i + 64 <= len; i += 64)
+	{
+		__mmask64 ne = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		if (ne)
+			return i + __builtin_ctzll(ne);
+	}
+	return i + MismatchAvx2(a + i, b + i, len - i);
+}
+#endif
+
+static const char *method;
+
+static MismatchFunc SelectMismatch()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+	{
+		method = "avx512";
+		return MismatchAvx512;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		method = "avx2";
+		return MismatchAvx2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		method = "sse2";
+		return MismatchSse2;
+	}
+#endif
+	method = "scalar";
+	return MismatchScalar;
+}
+
+static MismatchFunc Mismatch = SelectMismatch();
+
+const char *CompareBlocksMethod()
+{
+	return method;
+}
+
+int CompareBlocks(const char *block, const char *const *cands, int count, size_t len, int *result, size_t *offset)
+{
+	int matching = count;
+	for (int i = 0; i < count; ++i)
+	{
+		result[i] = 0;
+		if (offset)
+			offset[i] = len;
+	}
+	
+	size_t chunk = (count > COMPARE_FANOUT) ? len : COMPARE_CHUNK;
+	for (size_t pos = 0; pos < len && matching; pos += chunk)
+	{
+		size_t n = (len - pos < chunk) ? len - pos : chunk;
+		for (int i = 0; i < count; ++i)
+		{
+			if (result[i])
+				continue;
+			
+			size_t m = Mismatch(block + pos, cands[i] + pos, n);
+			if (m == n)
+				continue;
+			
+			result[i] = (int)(unsigned char)block[pos + m] - (int)(unsigned char)cands[i][pos + m];
+			if (offset)
+				offset[i] = pos + m;
+			matching--;
+		}
+	}
+	
+	return matching;
+}
@@ -0,0 +1,360 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "cache.h"
+#include "hash.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#define CACHE_MAGIC "FDUPCACH"
+#define CACHE_VERSION 2
+/* Stored in the header, so that files written on a machine of another byte
+ * order are not misread */
+#define CACHE_ORDER 0x01020304
+/* Most content hashes kept for each file */
+#define CACHE_MAX_SNAPSHOTS 32
+/* Records that no run has used for this long, in seconds, are dropped */
+#define CACHE_MAX_AGE (30 * 24 * 3600ULL)
+
+/* States of a loaded record in CompareCache::usage */
+enum
+{
+	RECORD_UNUSED,
+	RECORD_USED,
+	/* The file has changed since the record was made */
+	RECORD_STALE
+};
+
+struct CompareCache::Header
+{
+	char magic[8];
+	unsigned order;
+	unsigned version;
+	unsigned long long records, snapshots;
+};
+
+struct SnapshotLess
+{
+	bool operator()(const CompareCache::Snapshot &a, const CompareCache::Snapshot &b) const
+	{
+		return a.offset < b.offset;
+	}
+};
+
+CompareCache::CompareCache()
+	: map(MAP_FAILED), maplen(0), records(NULL), nrecords(0), snapshots(NULL), nsnapshots(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+CompareCache::~CompareCache()
+{
+	if (map != MAP_FAILED)
+		munmap(map, maplen);
+	pthread_mutex_destroy(&lock);
+}
+
+void CompareCache::Load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header))
+	{
+		close(fd);
+		return;
+	}
+	
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+	
+	const Header *h = (const Header*)p;
+	unsigned long long avail = st.st_size - sizeof(Header);
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) || h->order != CACHE_ORDER || h->version != CACHE_VERSION
+	    || h->records > avail / sizeof(Record)
+	    || (avail - h->records * sizeof(Record)) != h->snapshots * sizeof(Snapshot))
+	{
+		munmap(p, st.st_size);
+		return;
+	}
+	
+	map = p;
+	maplen = st.st_size;
+	records = (const Record*)(h + 1);
+	nrecords = h->records;
+	snapshots = (const Snapshot*)(records + nrecords);
+	nsnapshots = h->snapshots;
+	usage.assign(nrecords, RECORD_UNUSED);
+}
+
+/* Loaded record for a file, if it is still valid. Must be called with lock
+ * held. */
+const CompareCache::Record *CompareCache::Find(FileReference *file, off_t size)
+{
+	Key k(file->dev, file->ino);
+	unsigned long long lo = 0, hi = nrecords;
+	while (lo < hi)
+	{
+		unsigned long long mid = lo + (hi - lo) / 2;
+		if (Key(records[mid].dev, records[mid].ino) < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	if (lo == nrecords)
+		return NULL;
+	
+	const Record &r = records[lo];
+	if (r.dev != k.first || r.ino != k.second)
+		return NULL;
+	if (r.size != (unsigned long long)size || r.mtime != file->mtime || r.ctime != file->ctime
+	    || r.snapidx > nsnapshots || r.nsnaps > nsnapshots - r.snapidx)
+	{
+		usage[lo] = RECORD_STALE;
+		return NULL;
+	}
+	usage[lo] = RECORD_USED;
+	return &r;
+}
+
+/* Entry for a file from this run, if any. Must be called with lock held. */
+const CompareCache::Entry *CompareCache::FindUpdate(FileReference *file, off_t size) const
+{
+	std::map<Key, Entry>::const_iterator it = updates.find(Key(file->dev, file->ino));
+	if (it == updates.end())
+		return NULL;
+	
+	const Record &r = it->second.rec;
+	if (r.size != (unsigned long long)size || r.mtime != file->mtime || r.ctime != file->ctime)
+		return NULL;
+	return &it->second;
+}
+
+/* Entry for a file to be changed, starting from what is already known about
+ * it. Must be called with lock held. */
+CompareCache::Entry &CompareCache::Update(FileReference *file, off_t size)
+{
+	if (FindUpdate(file, size))
+		return updates[Key(file->dev, file->ino)];
+	
+	Entry &e = updates[Key(file->dev, file->ino)];
+	const Record *old = Find(file, size);
+	if (old)
+	{
+		e.rec = *old;
+		e.snaps.assign(snapshots + old->snapidx, snapshots + old->snapidx + old->nsnaps);
+		return e;
+	}
+	
+	memset(&e.rec, 0, sizeof(e.rec));
+	e.rec.dev = file->dev;
+	e.rec.ino = file->ino;
+	e.rec.size = size;
+	e.rec.mtime = file->mtime;
+	e.rec.ctime = file->ctime;
+	e.snaps.clear();
+	return e;
+}
+
+bool CompareCache::Sample(FileReference *file, off_t size, int sample, unsigned long long *hash)
+{
+	pthread_mutex_lock(&lock);
+	const Entry *e = FindUpdate(file, size);
+	const Record *r = e ? &e->rec : Find(file, size);
+	bool found = r && (r->flags & (1u << sample));
+	if (found)
+		*hash = r->samples[sample];
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+void CompareCache::SetSample(FileReference *file, off_t size, int sample, unsigned long long hash)
+{
+	pthread_mutex_lock(&lock);
+	Entry &e = Update(file, size);
+	e.rec.samples[sample] = hash;
+	e.rec.flags |= 1u << sample;
+	pthread_mutex_unlock(&lock);
+}
+
+void CompareCache::Snapshots(FileReference *file, off_t size, std::vector<Snapshot> &out)
+{
+	out.clear();
+	pthread_mutex_lock(&lock);
+	const Entry *e = FindUpdate(file, size);
+	if (e)
+		out = e->snaps;
+	else
+	{
+		const Record *r = Find(file, size);
+		if (r)
+			out.assign(snapshots + r->snapidx, snapshots + r->snapidx + r->nsnaps);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void CompareCache::AddSnapshots(FileReference *file, off_t size, const std::vector<Snapshot> &snaps)
+{
+	pthread_mutex_lock(&lock);
+	std::vector<Snapshot> &to = Update(file, size).snaps;
+	for (std::vector<Snapshot>::const_iterator it = snaps.begin(); it != snaps.end(); ++it)
+	{
+		std::vector<Snapshot>::iterator pos = std::lower_bound(to.begin(), to.end(), *it, SnapshotLess());
+		if (pos != to.end() && pos->offset == it->offset)
+			pos->hash = it->hash;
+		else
+			to.insert(pos, *it);
+	}
+	
+	/* Keep the earliest, and the hash of the whole file if there is one */
+	if (to.size() > CACHE_MAX_SNAPSHOTS)
+		to.erase(to.begin() + CACHE_MAX_SNAPSHOTS - 1, to.end() - 1);
+	pthread_mutex_unlock(&lock);
+}
+
+/* Walk the loaded records and the entries of this run together, in key
+ * order, counting them. Records are written for part 1, and their content
+ * hashes for part 2. Loaded records are left out if they are stale, or
+ * unused for CACHE_MAX_AGE before now. */
+void CompareCache::Write(FILE *f, int part, unsigned long long cutoff, unsigned long long now,
+                         unsigned long long *nrec, unsigned long long *nsnap)
+{
+	std::map<Key, Entry>::const_iterator up = updates.begin();
+	unsigned long long ri = 0;
+	*nrec = *nsnap = 0;
+	
+	while (ri < nrecords || up != updates.end())
+	{
+		const Record *rec;
+		const Snapshot *snaps;
+		unsigned n;
+		bool used = true;
+		
+		if (up != updates.end() && (ri >= nrecords || up->first <= Key(records[ri].dev, records[ri].ino)))
+		{
+			/* Replaces the loaded record of the same file */
+			if (ri < nrecords && up->first == Key(records[ri].dev, records[ri].ino))
+				ri++;
+			
+			const Entry &e = (up++)->second;
+			if (e.rec.mtime >= cutoff || e.rec.ctime >= cutoff)
+				continue;
+			rec = &e.rec;
+			snaps = e.snaps.empty() ? NULL : &e.snaps[0];
+			n = e.snaps.size();
+		}
+		else
+		{
+			unsigned char state = usage[ri];
+			const Record &r = records[ri++];
+			if (state == RECORD_STALE || r.snapidx > nsnapshots || r.nsnaps > nsnapshots - r.snapidx)
+				continue;
+			used = (state == RECORD_USED);
+			if (!used && r.used + CACHE_MAX_AGE < now)
+				continue;
+			rec = &r;
+			snaps = snapshots + r.snapidx;
+			n = r.nsnaps;
+		}
+		
+		if (part == 1)
+		{
+			Record out = *rec;
+			out.nsnaps = n;
+			out.snapidx = *nsnap;
+			if (used)
+				out.used = now;
+			fwrite(&out, sizeof(out), 1, f);
+		}
+		else if (part == 2 && n)
+			fwrite(snaps, sizeof(Snapshot), n, f);
+		
+		(*nrec)++;
+		*nsnap += n;
+	}
+}
+
+bool CompareCache::Save(const char *path, unsigned long long cutoff)
+{
+	/* Written beside the old file, and renamed over it once complete, so
+	 * that the cache is never seen half written */
+	std::string tmp = std::string(path) + ".XXXXXX";
+	std::vector<char> tmpname(tmp.begin(), tmp.end());
+	tmpname.push_back('\0');
+	
+	int fd = mkstemp(&tmpname[0]);
+	if (fd < 0)
+		return false;
+	
+	FILE *f = fdopen(fd, "wb");
+	if (!f)
+	{
+		int err = errno;
+		close(fd);
+		unlink(&tmpname[0]);
+		errno = err;
+		return false;
+	}
+	
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	h.order = CACHE_ORDER;
+	h.version = CACHE_VERSION;
+	
+	unsigned long long nrec, nsnap, now = time(NULL);
+	this->Write(f, 0, cutoff, now, &h.records, &h.snapshots);
+	fwrite(&h, sizeof(h), 1, f);
+	this->Write(f, 1, cutoff, now, &nrec, &nsnap);
+	this->Write(f, 2, cutoff, now, &nrec, &nsnap);
+	
+	bool ok = !ferror(f) && fflush(f) == 0 && fsync(fd) == 0;
+	int err = errno;
+	if (fclose(f) != 0 && ok)
+	{
+		ok = false;
+		err = errno;
+	}
+	if (ok && rename(&tmpname[0], path) < 0)
+	{
+		ok = false;
+		err = errno;
+	}
+	
+	if (!ok)
+	{
+		unlink(&tmpname[0]);
+		errno = err;
+	}
+	return ok;
+}
+
+unsigned long long CompareCache::Chain(unsigned long long h, const char *data, size_t len)
+{
+	for (size_t u = 0; u < len; u += CACHE_UNIT)
+		h = Hash64(data + u, (len - u < CACHE_UNIT) ? len - u : CACHE_UNIT, h);
+	return h;
+}
@@ -16,11 +16,16 @@
  */
 
 #include "main.h"
+#include "reader.h"
+#include "hash.h"
+#include "cache.h"
+#include "blockcmp.h"
+#include "stats.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <math.h>
+#include <algorithm>
 
 /* Deep comparison is the clever technique upon which the entire
  * concept of fastdup is based.
@@ -38,255 +43,641 @@
  * Deep comparison compares files byte by byte, but does so very
  * intelligently. We've already got files in sets by filesize, which
  * dramatically reduces the number of comparisons necessary. The
- * idea is to compare every file to every other file in blocks, but
- * with the use of a number of tricks to reduce the number of
- * comparisons actually necessary. As a result, this method will work
- * fastest on files that are not duplicates (which will be eliminated
- * as soon as they cannot match anything else), which are far more
- * common in most datasets than non-duplicates. See the code for
- * details on how exactly this is optimized down from needing full
- * O(n^n) comparisons on the contents of every file - there are many
- * methods, some of which are quite intricate.
+ * idea is to read all of the files in blocks, and to split them into
+ * ever smaller classes of files whose blocks have all been identical,
+ * without ever comparing every file to every other file. As a result,
+ * this method will work fastest on files that are not duplicates
+ * (which will be eliminated as soon as they cannot match anything
+ * else), which are far more common in most datasets than
+ * non-duplicates. A hash of a block is only ever used to decide which
+ * files to compare; files are only considered identical once every
+ * byte has been compared. See CompareFiles for details.
+ *
+ * The one exception is -H (opt.hashmin) without -V (opt.verify): large
+ * sets are then split by a 128-bit hash of each whole file, and files with
+ * the same hash are reported without their bytes being compared. That is
+ * probabilistic, as hashing always is; see CompareHashed.
  */
 
-#define BLOCKSIZE 65536
+/* Files are compared in blocks that start out small, as most files that
+ * differ do so within their first few KiB, and double in size with every
+ * block in which no more files were told apart, so that duplicates end up
+ * being read in long sequential runs. Blocks are kept to a multiple of the
+ * preferred I/O size of the files, and limited so that the blocks of a
+ * large set of files don't use too much memory. */
+#define BLOCK_MIN 4096
+#define BLOCK_MAX (8 * 1048576)
+#define BLOCK_BUDGET (64 * 1048576)
 
-void FastDup::Compare(FileReference *first, off_t filesize, DupeSetCallback callback)
+/* Size of the first block, and the unit of all blocks after it, from the
+ * descriptors the reader has open anyway */
+static size_t ProbeBlockSize(BlockReader *reader)
 {
-	int blockcount = (int)ceil(filesize / BLOCKSIZE);
+	size_t size = reader->IoSize();
+	if (size < BLOCK_MIN)
+		return BLOCK_MIN;
+	if (size > BLOCK_MAX)
+		return BLOCK_MAX;
+	return size;
+}
 
-	int fcount = 0;
+static bool InodeLess(const FileReference *a, const FileReference *b)
+{
+	return (a->dev < b->dev) || (a->dev == b->dev && a->ino < b->ino);
+}
+
+void FastDup::Compare(FileReference *first, off_t filesize, DupeSetList &results)
+{
+	/* Hardlinks share the same inode, so they are certainly identical and
+	 * there's no point in reading the same data more than once. Paths are
+	 * grouped by inode, each group is reported as already linked, and only
+	 * the first path of each inode takes part in the comparison. */
+	std::vector<FileReference*> files;
 	for (FileReference *p = first; p; p = p->next)
-		++fcount;
-	
-	bool progress = (Interactive && (filesize*fcount >= 3*1048576));
-	int ipint = 0;
-	if (progress)
-	{
-		ipint = (int)ceil(double(blockcount*fcount)/100);
-		printf("Comparing %d files... \E[s0%%", fcount);
-		fflush(stdout);
-	}
+		files.push_back(p);
+	std::stable_sort(files.begin(), files.end(), InodeLess);
 	
-	/* FDs */
-	int ffd[fcount];
 	/* File reference map, used afterwards to map back to the real file */
-	FileReference *frmap[fcount];
-	/* Data buffers */
-	char *rrdbuf = new char[fcount * BLOCKSIZE];
-	char *rdbuf[fcount];
-	ssize_t rdbp = 0;
-	/* Matchflag is 1 for each file pair that may still match, 0
-	 * for pairs that cannot match, or 2 indicating that the current
-	 * block of both files is known to match (which will be reset
-	 * to 1 before the next block).
-	 *
-	 * To save space, a somewhat complex equation is used to calculate
-	 * the positions of the flag for a given pair of files (i and j).
-	 * The result of this equation is to map them so that, if there are
-	 * 3 files total, [0] is 0 & 1, [1] is 0 & 2, [2] is 1 & 2, and
-	 * no space is wasted.
-	 *
-	 * To calculate the position for files i and j with a maximum of f
-	 * files, assuming that j > i, use:
-	 *     int(((f-1)*i)-(i*(i/2.0-0.5))+(j-i)-1);
-	 */
-	char matchflag[(fcount*(fcount-1))/2];
-#define FLAGPOS(i,j) int(((fcount-1)*(i))-((i)*((i)/2.0-0.5))+((j)-(i))-1)
-	/* Holds the result for the matching of the current file (i) against
-	 * all other TESTED files, by the index of the second file (j). Note
-	 * that many parts of this may be left untouched due to other
-	 * optimizations preventing a comparison. Use only when that
-	 * information is known. Values are identical to the return of
-	 * memcmp; -1 for i < j, 0 for i == j, 1 for i > j.
-	 *
-	 * Used to avoid comparisons by finding when two other files cannot
-	 * match this block, or must match this block (i.e. i > j and i < k,
-	 * or i == j and i == k).
-	 */
-	int mresult[fcount];
-	/* Omit is true for files that have no possible matches left. These
-	 * are not read or processed at all. */
-	bool omit[fcount];
-	/* Number of files omitted; used to end early if we run out of possible
-	 * matches */
-	int omitted = 0;
-	/* Used to calculate omit, by keeping track of the number of comparisons
-	 * with other files that have been skipped against this file. When this
-	 * reaches fcount for a given file index, that file may be omitted. */
-	int skipcount[fcount];
-	
-	memset(matchflag, 1, sizeof(matchflag));
-	memset(omit, false, sizeof(omit));
-	memset(skipcount, 0, sizeof(skipcount));
-	
-	int i = 0, j = 0;
-	for (FileReference *p = first; p; p = p->next, ++i)
+	std::vector<FileReference*> frmap(files.size());
+	int fcount = 0;
+	for (size_t i = 0, j; i < files.size(); i = j)
 	{
-		frmap[i] = p;
-		const char *fn = p->FullPath();
+		for (j = i + 1; j < files.size() && !InodeLess(files[i], files[j]); ++j)
+			;
 		
-		rdbuf[i] = rrdbuf + (BLOCKSIZE * i);
+		if (j - i > 1)
+		{
+			Stats::Count(STAT_LINKED, j - i - 1);
+			results.push_back(DupeSet());
+			results.back().linked = true;
+			results.back().files.assign(files.begin() + i, files.begin() + j);
+		}
 		
-		if ((ffd[i] = open(fn, O_RDONLY)) < 0)
+		frmap[fcount++] = files[i];
+	}
+	
+	if (fcount < 2)
+		return;
+	
+	if (opt.dedupe && this->CompareDeduped(&frmap[0], fcount, filesize, results))
+		return;
+	
+	if (opt.hashmin && (unsigned long)fcount > opt.hashmin)
+	{
+		this->CompareHashed(&frmap[0], fcount, filesize, results);
+		return;
+	}
+	
+	size_t nresults = results.size();
+	BlockReader *reader = BlockReader::Create(opt, CompareThreads, &frmap[0], fcount, filesize);
+	if (!this->CompareFiles(&frmap[0], fcount, filesize, reader, results))
+	{
+		/* The files changed in a way the reader could not recover from, so
+		 * start over reading them normally */
+		results.resize(nresults);
+		if (!this->CompareFiles(&frmap[0], fcount, filesize, new ReadBlockReader(&frmap[0], fcount, filesize, BlockReader::FdBudget(opt, CompareThreads), opt.iopolicy), results))
 		{
-			printf("Unable to open file '%s': %s\n", fn, strerror(errno));
-			// Note: if handled in any other way, clean up open FDs and rrdbuf
-			exit(EXIT_FAILURE);
+			char path[PATH_MAX];
+			fprintf(stderr, "Unable to compare %d files of %lld bytes, such as '%s': they changed while being read\n",
+			        fcount, (long long)filesize, frmap[0]->Path(path, sizeof(path)));
+			results.resize(nresults);
 		}
 	}
+}
+
+/* Classes of files up to this size are split by comparing every file with
+ * the first; larger ones are sorted by a hash of their block first */
+#define SMALL_CLASS 8
+
+struct HashOrder
+{
+	const std::vector<unsigned long long> &hash;
+	
+	HashOrder(const std::vector<unsigned long long> &h) : hash(h) { }
 	
-	// Loop over blocks of the files, which will be compared
-	int ti = 0;
-	for (int block = 0;; ++block)
+	bool operator()(int a, int b) const
+	{
+		return hash[a] < hash[b];
+	}
+};
+
+/* Split a class of files into sets whose current block is identical, and
+ * append those to out. The first file is compared with all of the others,
+ * and those which match it form a set; this is repeated with the files that
+ * are left. That is all it takes when the files are duplicates, but when
+ * many files are left, they are sorted by a hash of the block instead, and
+ * only files with equal hashes are compared. */
+static void SplitClass(BlockReader *reader, size_t len, std::vector<int> &files, std::vector<unsigned long long> &hash,
+                       bool hashed, std::vector<std::vector<int> > &out)
+{
+	std::vector<int> same, rest, result(files.size());
+	std::vector<const char*> cands(files.size());
+	while (!files.empty())
 	{
-		for (i = 0; i < fcount; i++)
+		for (size_t i = 1; i < files.size(); ++i)
+			cands[i - 1] = reader->Data(files[i]);
+		CompareBlocks(reader->Data(files[0]), &cands[0], files.size() - 1, len, &result[0], NULL);
+		Stats::Count(STAT_COMPARES, files.size() - 1);
+		Stats::Count(STAT_COMPARE_BYTES, (files.size() - 1) * len);
+		
+		same.assign(1, files[0]);
+		rest.clear();
+		for (size_t i = 1; i < files.size(); ++i)
 		{
-			if (omit[i])
-				continue;
+			if (!result[i - 1])
+				same.push_back(files[i]);
+			else
+				rest.push_back(files[i]);
+		}
+		
+		out.push_back(same);
+		files.swap(rest);
+		
+		if (!hashed && files.size() > SMALL_CLASS)
+		{
+			Stats::Count(STAT_HASH_SORTED, files.size());
+			for (std::vector<int>::iterator it = files.begin(); it != files.end(); ++it)
+				hash[*it] = Hash64(reader->Data(*it), len);
+			std::stable_sort(files.begin(), files.end(), HashOrder(hash));
 			
-			rdbp = read(ffd[i], rdbuf[i], BLOCKSIZE);
-
-			if (progress && (++ti == ipint))
+			for (size_t i = 0, j; i < files.size(); i = j)
 			{
-				ti = 0;
-				fprintf(stdout, "\E[u%d%%", int((double((block+1)*(i+1))/(blockcount*fcount))*100));
-				fflush(stdout);
+				for (j = i + 1; j < files.size() && hash[files[j]] == hash[files[i]]; ++j)
+					;
+				std::vector<int> run(files.begin() + i, files.begin() + j);
+				SplitClass(reader, len, run, hash, true, out);
 			}
-			
-			if (rdbp < 0)
+			return;
+		}
+	}
+}
+
+/* Split files by the content hashes cached for them, at offsets past after
+ * that all of them have hashes for, as far as those tell them apart. This
+ * retraces the splits the files went through when they were last compared.
+ */
+static void SplitCached(const std::vector<std::vector<CompareCache::Snapshot> > &snaps, std::vector<int> &files,
+                        unsigned long long after, std::vector<std::vector<int> > &out)
+{
+	if (files.size() < 2)
+	{
+		out.push_back(files);
+		return;
+	}
+	
+	std::vector<unsigned long long> hash(files.size());
+	const std::vector<CompareCache::Snapshot> &first = snaps[files[0]];
+	for (std::vector<CompareCache::Snapshot>::const_iterator it = first.begin(); it != first.end(); ++it)
+	{
+		if (it->offset <= after)
+			continue;
+		
+		bool shared = true, differ = false;
+		for (size_t i = 0; shared && i < files.size(); ++i)
+		{
+			const std::vector<CompareCache::Snapshot> &fs = snaps[files[i]];
+			shared = false;
+			for (size_t j = 0; j < fs.size() && fs[j].offset <= it->offset; ++j)
 			{
-				printf("%d: Read error: %s\n", i, strerror(errno));
-				// Note: if handled in any other way, cleanup
-				exit(EXIT_FAILURE);
+				if (fs[j].offset == it->offset)
+				{
+					shared = true;
+					hash[i] = fs[j].hash;
+					differ |= (hash[i] != it->hash);
+				}
 			}
-			else if (!rdbp)
+		}
+		
+		if (!shared || !differ)
+			continue;
+		
+		std::vector<int> order(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), HashOrder(hash));
+		
+		for (size_t i = 0, j; i < order.size(); i = j)
+		{
+			std::vector<int> part;
+			for (j = i; j < order.size() && hash[order[j]] == hash[order[i]]; ++j)
+				part.push_back(files[order[j]]);
+			SplitCached(snaps, part, it->offset, out);
+		}
+		return;
+	}
+	
+	out.push_back(files);
+}
+
+/* Compare a set of files that are all different inodes. Takes ownership of
+ * reader. Returns false if the reader became unreliable partway through, in
+ * which case nothing is added to results.
+ *
+ * The files are kept in classes of files that have been identical in every
+ * block so far, starting with a single class of all of them. Each block
+ * splits the classes by the contents of that block. A file that is left
+ * alone in its class can't match anything, and is not read any further; the
+ * comparison ends as soon as no class is left, which for files that are not
+ * duplicates is usually after the first block. The work for each block is
+ * at most n log n in the number of files, and memory is linear in it.
+ *
+ * With a cache, files that it proves to be different are split before
+ * anything is read, and the hash of what has been read of each file is kept
+ * as it goes, to be cached at each offset where a class is split. Once the
+ * reader skips a hole or returns a block that is not aligned to CACHE_UNIT,
+ * the hashes would no longer match those of other runs, so no more are kept.
+ */
+bool FastDup::CompareFiles(FileReference **frmap, int fcount, off_t filesize, BlockReader *reader, DupeSetList &results)
+{
+	/* Only the smallest blocks can go over budget, for a very large set */
+	size_t blockmax = BLOCK_BUDGET / fcount;
+	if (blockmax > BLOCK_MAX)
+		blockmax = BLOCK_MAX;
+	blockmax -= blockmax % BLOCK_MIN;
+	if (blockmax < BLOCK_MIN)
+		blockmax = BLOCK_MIN;
+	size_t blocksize = ProbeBlockSize(reader);
+	if (blocksize > blockmax)
+		blocksize = blockmax;
+	blockmax -= blockmax % blocksize;
+	
+	/* Progress can't be shown while other threads are comparing as well */
+	bool progress = (Interactive && opt.threads <= 1 && !opt.devdepth && (filesize*fcount >= 3*1048576));
+	off_t position = 0;
+	int percent = -1;
+	if (progress)
+	{
+		printf("Comparing %d files... \E[s0%%", fcount);
+		fflush(stdout);
+	}
+	
+	/* Classes of files, by their index in frmap */
+	std::vector<std::vector<int> > classes(1), next;
+	for (int i = 0; i < fcount; i++)
+		classes[0].push_back(i);
+	std::vector<unsigned long long> hash(fcount);
+	
+	/* Content hash of each file so far, and the hashes to cache for it */
+	bool record = Cache && !(blocksize % CACHE_UNIT), chaining = record;
+	std::vector<unsigned long long> chain;
+	std::vector<std::vector<CompareCache::Snapshot> > snaps;
+	if (Cache)
+	{
+		snaps.resize(fcount);
+		for (int i = 0; i < fcount; i++)
+			Cache->Snapshots(frmap[i], filesize, snaps[i]);
+		
+		std::vector<int> all;
+		all.swap(classes[0]);
+		classes.clear();
+		SplitCached(snaps, all, 0, classes);
+		
+		size_t n = 0;
+		for (size_t i = 0; i < classes.size(); ++i)
+		{
+			if (classes[i].size() == 1)
 			{
-				// All files are assumed to be equal in size
-				break;
+				Stats::Count(STAT_CACHE_SPLITS);
+				reader->Drop(classes[i][0]);
+				continue;
 			}
+			if (n != i)
+				classes[n].swap(classes[i]);
+			n++;
 		}
+		classes.resize(n);
 		
-		if (!rdbp)
+		chain.resize(fcount, 0);
+		for (int i = 0; i < fcount; i++)
+			snaps[i].clear();
+	}
+	
+	while (!classes.empty())
+	{
+		ssize_t rdbp = reader->Next(blocksize);
+		if (!rdbp || reader->Unreliable())
 			break;
 		
-		for (i = 0; i < fcount; i++)
+		/* Hashes are chained over whole units from the start of the file,
+		 * so that they don't depend on the blocks it was read in; a block
+		 * that doesn't start and end between units ends the chain, as does
+		 * a skipped hole */
+		position = reader->Offset();
+		if (reader->Skipped() || (position - rdbp) % CACHE_UNIT || (rdbp % CACHE_UNIT && position != filesize))
+			chaining = false;
+		if (progress && int(position * 100 / filesize) != percent)
 		{
-			if (omit[i])
-				continue;
+			percent = int(position * 100 / filesize);
+			fprintf(stdout, "\E[u%d%%", percent);
+			fflush(stdout);
+		}
+		
+		/* Set when a class is split by this block */
+		bool differed = false;
+		
+		next.clear();
+		for (std::vector<std::vector<int> >::iterator it = classes.begin(); it != classes.end(); ++it)
+		{
+			/* Files that changed or could not be read can't match anything */
+			std::vector<int> &cls = *it;
+			size_t n = 0;
+			for (size_t i = 0; i < cls.size(); ++i)
+			{
+				if (!reader->Failed(cls[i]))
+					cls[n++] = cls[i];
+			}
+			cls.resize(n);
 			
-			for (j = i + 1; j < fcount; j++)
+			if (chaining)
 			{
-				if (omit[j])
-					continue;
-				
-				int flagpos = FLAGPOS(i, j);
-				if (!matchflag[flagpos])
-					continue;
-				else if (matchflag[flagpos] == 2)
-				{
-					matchflag[flagpos] = 1;
-					mresult[j] = 0;
-				}
-				else
-					mresult[j] = memcmp(rdbuf[i], rdbuf[j], rdbp);
+				for (size_t i = 0; i < cls.size(); ++i)
+					chain[cls[i]] = CompareCache::Chain(chain[cls[i]], reader->Data(cls[i]), rdbp);
+			}
+			
+			size_t first = next.size();
+			SplitClass(reader, rdbp, cls, hash, false, next);
+			if (next.size() - first > 1)
+			{
+				differed = true;
 				
-				for (int k = j - 1; k > i; --k)
+				if (chaining)
 				{
-					if (omit[k])
-						continue;
-					
-					int kflagpos = FLAGPOS(k, j);
-					if (!matchflag[kflagpos])
-						continue;
-					
-					if (mresult[k] != mresult[j])
+					for (size_t c = first; c < next.size(); ++c)
 					{
-						matchflag[kflagpos] = 0;
-						++skipcount[j];
-						if (++skipcount[k] == fcount - 1)
+						for (std::vector<int>::iterator fi = next[c].begin(); fi != next[c].end(); ++fi)
 						{
-							omit[k] = true;
-							close(ffd[k]);
-							ffd[k] = -1;
-							omitted++;
+							CompareCache::Snapshot snap = { (unsigned long long)position, chain[*fi] };
+							snaps[*fi].push_back(snap);
 						}
 					}
-					else if (mresult[k] == 0 && mresult[j] == 0)
-					{
-						/* These will be equal, so we can avoid comparing them; signal this by setting
-						 * matchflag to 2 for this block (it is one-shot, and will be reset before the
-						 * next block). This is a huge saver when there is more than one duplicate of
-						 * the same file. */
-						matchflag[kflagpos] = 2;
-					}
-				}
-				
-				if (mresult[j] != 0)
-				{
-					matchflag[flagpos] = 0;
-					skipcount[i]++;
-					if (++skipcount[j] == fcount - 1)
-					{
-						omit[j] = true;
-						close(ffd[j]);
-						ffd[j] = -1;
-						omitted++;
-					}
 				}
 			}
-			
-			if (skipcount[i] == fcount - 1)
+		}
+		
+		/* Stop reading files that are on their own */
+		size_t n = 0;
+		for (size_t i = 0; i < next.size(); ++i)
+		{
+			if (next[i].size() == 1)
 			{
-				omit[i] = true;
-				close(ffd[i]);
-				ffd[i] = -1;
-				if (++omitted == fcount)
-					goto endscan;
+				Stats::Count(STAT_EARLY_OMITS);
+				Stats::Count(STAT_OMITTED_BYTES, filesize - position);
+				reader->Drop(next[i][0]);
+				continue;
 			}
+			if (n != i)
+				next[n].swap(next[i]);
+			n++;
+		}
+		next.resize(n);
+		classes.swap(next);
+		
+		if (!differed && blocksize < blockmax)
+		{
+			blocksize *= 2;
+			if (blocksize > blockmax)
+				blocksize = blockmax;
 		}
 	}
 	
- endscan:
- 	delete []rrdbuf;
- 	
- 	/* Cleanup and gather/process results */
- 	
- 	if (progress)
- 		fputs("\E[0G\E[K", stdout);
- 	
- 	FileReference *re[fcount];
- 	unsigned long relen = 0;
- 	
-	for (i = 0; i < fcount; i++)
+	if (record && !reader->Unreliable())
 	{
-		if (omit[i])
-			continue;
-		close(ffd[i]);
-		
-		relen = 0;
-		for (int j = i + 1; j < fcount; j++)
+		/* Files still in a class have been read to the end */
+		if (chaining && position == filesize)
 		{
-			if (!omit[j] && matchflag[FLAGPOS(i,j)])
+			for (std::vector<std::vector<int> >::iterator it = classes.begin(); it != classes.end(); ++it)
 			{
-				if (!relen)
-					re[relen++] = frmap[i];
-				re[relen++] = frmap[j];
-				
-				/* Prevent this from showing up again in our results */
-				omit[j] = true;
-				close(ffd[j]);
+				for (std::vector<int>::iterator fi = it->begin(); fi != it->end(); ++fi)
+				{
+					CompareCache::Snapshot snap = { (unsigned long long)filesize, chain[*fi] };
+					snaps[*fi].push_back(snap);
+				}
 			}
 		}
 		
-		if (relen)
+		for (int i = 0; i < fcount; i++)
+		{
+			if (!snaps[i].empty() && !reader->Failed(i))
+				Cache->AddSnapshots(frmap[i], filesize, snaps[i]);
+		}
+	}
+	
+	bool reliable = !reader->Unreliable();
+	delete reader;
+	
+	/* Cleanup and gather/process results */
+	
+	if (progress)
+		fputs("\E[0G\E[K", stdout);
+	
+	if (!reliable)
+		return false;
+	
+	/* Report sets in the order of their files in frmap */
+	for (std::vector<std::vector<int> >::iterator it = classes.begin(); it != classes.end(); ++it)
+		std::sort(it->begin(), it->end());
+	std::sort(classes.begin(), classes.end());
+	
+	for (std::vector<std::vector<int> >::iterator it = classes.begin(); it != classes.end(); ++it)
+	{
+		results.push_back(DupeSet());
+		for (std::vector<int>::iterator fi = it->begin(); fi != it->end(); ++fi)
+			results.back().files.push_back(frmap[*fi]);
+	}
+	
+	return true;
+}
+
+/* Files are hashed whole, one at a time, reading this much at once */
+#define HASH_BUFFER 1048576
+
+struct FileDigest
+{
+	unsigned long long digest[2];
+	int index;
+	
+	bool operator<(const FileDigest &o) const
+	{
+		if (digest[0] != o.digest[0])
+			return digest[0] < o.digest[0];
+		if (digest[1] != o.digest[1])
+			return digest[1] < o.digest[1];
+		return index < o.index;
+	}
+	
+	bool operator==(const FileDigest &o) const
+	{
+		return digest[0] == o.digest[0] && digest[1] == o.digest[1];
+	}
+};
+
+static int OpenSequential(FileReference *file, IoPolicy policy)
+{
+	char path[PATH_MAX];
+	int fd = OpenForCompare(file->Path(path, sizeof(path)), policy);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Unable to open file '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return fd;
+}
+
+/* Read the next piece of a file into buf; returns its length, or -1 */
+static ssize_t ReadPiece(int fd, char *buf, off_t offset, off_t filesize, IoPolicy policy)
+{
+	size_t len = (filesize - offset < HASH_BUFFER) ? filesize - offset : HASH_BUFFER;
+	ssize_t got = ReadForCompare(fd, buf, len, offset, policy);
+	return ((size_t)got == len) ? got : -1;
+}
+
+/* Hash the whole of a file. Returns false if it could not be read, or no
+ * longer has the size it was scanned with. */
+static bool HashFile(FileReference *file, off_t filesize, char *buf, IoPolicy policy, unsigned long long digest[2])
+{
+	int fd = OpenSequential(file, policy);
+	if (fd < 0)
+		return false;
+	
+	Hash128 hash;
+	off_t offset = 0;
+	while (offset < filesize)
+	{
+		ssize_t len = ReadPiece(fd, buf, offset, filesize, policy);
+		if (len < 0)
+			break;
+		hash.Update(buf, len);
+		offset += len;
+	}
+	
+	/* Anything past the end means the file has grown */
+	bool ok = (offset == filesize && ReadForCompare(fd, buf, 1, filesize, policy) == 0);
+	close(fd);
+	
+	hash.Final(digest);
+	return ok;
+}
+
+/* Compare two files byte by byte */
+static bool SameContents(FileReference *a, FileReference *b, off_t filesize, char *bufa, char *bufb, IoPolicy policy)
+{
+	int fda = OpenSequential(a, policy);
+	if (fda < 0)
+		return false;
+	int fdb = OpenSequential(b, policy);
+	if (fdb < 0)
+	{
+		close(fda);
+		return false;
+	}
+	
+	bool same = true;
+	for (off_t offset = 0; same && offset < filesize;)
+	{
+		ssize_t len = ReadPiece(fda, bufa, offset, filesize, policy);
+		same = (len > 0 && ReadPiece(fdb, bufb, offset, filesize, policy) == len);
+		if (same)
+		{
+			Stats::Count(STAT_COMPARES);
+			Stats::Count(STAT_COMPARE_BYTES, len);
+			same = !memcmp(bufa, bufb, len);
+		}
+		offset += len;
+	}
+	
+	close(fda);
+	close(fdb);
+	return same;
+}
+
+/* Compare a large set of files by hashing each of them whole, one at a
+ * time, rather than reading all of them at once; files with the same hash
+ * are duplicates. When most of the files are duplicates, every file has to
+ * be read to the end either way, and this reads each file in one sequential
+ * sweep with a single buffer, rather than switching between thousands of
+ * files a block at a time.
+ *
+ * Without opt.verify, files are reported as duplicates on their hash
+ * alone, so that a collision of the 128-bit hash would report different
+ * files as duplicates; that is unlikely by chance, but not impossible, and
+ * could be done deliberately. With opt.verify, each file is compared byte
+ * by byte with the first file of its hash as well. If that finds a difference (which would take a
+ * deliberate collision, or a file changing while it is compared), those
+ * files are compared in the usual way instead.
+ */
+void FastDup::CompareHashed(FileReference **frmap, int fcount, off_t filesize, DupeSetList &results)
+{
+	IoBuffer buf;
+	buf.Reserve(HASH_BUFFER * (opt.verify ? 2 : 1));
+	Stats::Buffer(buf.Size());
+	
+	/* Read files in the order they are stored on disk, if asked to */
+	std::vector<std::pair<PhysicalKey, int> > order(fcount);
+	for (int i = 0; i < fcount; ++i)
+		order[i] = std::make_pair(opt.physical ? PhysicalStart(frmap[i]) : PhysicalKey(0, 0), i);
+	if (opt.physical)
+		std::sort(order.begin(), order.end());
+	
+	std::vector<FileDigest> digests;
+	for (int i = 0; i < fcount; ++i)
+	{
+		FileDigest d;
+		d.index = order[i].second;
+		if (HashFile(frmap[d.index], filesize, buf.Data(), opt.iopolicy, d.digest))
+			digests.push_back(d);
+	}
+	std::sort(digests.begin(), digests.end());
+	
+	std::vector<std::vector<int> > sets;
+	for (size_t i = 0, j; i < digests.size(); i = j)
+	{
+		for (j = i + 1; j < digests.size() && digests[j] == digests[i]; ++j)
+			;
+		if (j - i < 2)
+			continue;
+		
+		std::vector<int> set;
+		for (size_t k = i; k < j; ++k)
+			set.push_back(digests[k].index);
+		
+		bool verified = true;
+		for (size_t k = 1; opt.verify && verified && k < set.size(); ++k)
+			verified = SameContents(frmap[set[0]], frmap[set[k]], filesize, buf.Data(), buf.Data() + HASH_BUFFER,
+			                        opt.iopolicy);
+		
+		if (verified)
+		{
+			sets.push_back(set);
+			continue;
+		}
+		
+		std::vector<FileReference*> files;
+		for (std::vector<int>::iterator it = set.begin(); it != set.end(); ++it)
+			files.push_back(frmap[*it]);
+		DupeSetList found;
+		ReadBlockReader *reader = new ReadBlockReader(&files[0], files.size(), filesize,
+		                                              BlockReader::FdBudget(opt, CompareThreads), opt.iopolicy);
+		this->CompareFiles(&files[0], files.size(), filesize, reader, found);
+		for (DupeSetList::iterator it = found.begin(); it != found.end(); ++it)
 		{
-			DupeSetCount++;
-			DupeFileCount += relen;
-			callback(re, relen, filesize);
+			std::vector<int> part;
+			for (std::vector<FileReference*>::iterator fi = it->files.begin(); fi != it->files.end(); ++fi)
+				part.push_back(set[std::find(files.begin(), files.end(), *fi) - files.begin()]);
+			sets.push_back(part);
 		}
 	}
 	
-	return;
+	Stats::Buffer(-(long long)buf.Size());
+	
+	/* Report sets in the order of their files in frmap, as CompareFiles does */
+	std::sort(sets.begin(), sets.end());
+	for (std::vector<std::vector<int> >::iterator it = sets.begin(); it != sets.end(); ++it)
+	{
+		results.push_back(DupeSet());
+		for (std::vector<int>::iterator fi = it->begin(); fi != it->end(); ++fi)
+			results.back().files.push_back(frmap[*fi]);
+	}
 }
-#undef FLAGPOS
@@ -0,0 +1,223 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <algorithm>
+
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
+/* Filesystems that share extents between files (btrfs and XFS, at least)
+ * can be asked to compare ranges of two files themselves, and to share
+ * the extents of the ranges that are the same. The comparison happens in
+ * the kernel, so no data is copied out to be compared, and the space taken
+ * by duplicates is reclaimed in the same pass.
+ *
+ * Ranges are deduplicated in pieces of this size; btrfs does no more than
+ * this at once. The number of files in each call is limited so that its
+ * arguments fit in a page, which is what the kernel allows.
+ */
+#define DEDUPE_CHUNK (16 * 1048576)
+#define DEDUPE_FILES 120
+/* Pieces the kernel did not finish are compared by reading this much */
+#define DEDUPE_BUFFER 1048576
+
+#ifdef FIDEDUPERANGE
+
+/* Compare a range of two files by reading them */
+static bool SameRange(int fda, int fdb, off_t offset, off_t len)
+{
+	std::vector<char> a(DEDUPE_BUFFER), b(DEDUPE_BUFFER);
+	while (len > 0)
+	{
+		size_t n = (len < DEDUPE_BUFFER) ? len : DEDUPE_BUFFER;
+		if (CountedPread(fda, &a[0], n, offset) != (ssize_t)n || CountedPread(fdb, &b[0], n, offset) != (ssize_t)n)
+			return false;
+		Stats::Count(STAT_COMPARES);
+		Stats::Count(STAT_COMPARE_BYTES, n);
+		if (memcmp(&a[0], &b[0], n))
+			return false;
+		offset += n;
+		len -= n;
+	}
+	return true;
+}
+
+static int OpenDedupe(FileReference *file, bool dest)
+{
+	char path[PATH_MAX];
+	file->Path(path, sizeof(path));
+	
+	/* Destinations must be writable, unless we own them or are privileged */
+	int fd = dest ? CountedOpen(path, O_RDWR) : -1;
+	if (fd < 0)
+		fd = CountedOpen(path, O_RDONLY);
+	if (fd < 0)
+		fprintf(stderr, "Unable to open file '%s': %s\n", path, strerror(errno));
+	return fd;
+}
+
+/* Compare a set of files on one filesystem by deduplicating the rest of
+ * them against the first. Files that are found to differ from it are then
+ * deduplicated against the first of those, and so on. Returns false if the
+ * filesystem can't do it, in which case the files must be compared in the
+ * usual way. */
+bool FastDup::CompareDeduped(FileReference **frmap, int fcount, off_t filesize, DupeSetList &results)
+{
+	for (int i = 1; i < fcount; ++i)
+	{
+		if (frmap[i]->dev != frmap[0]->dev)
+			return false;
+	}
+	
+	std::vector<int> fds(fcount, -1);
+	for (int i = 0; i < fcount; ++i)
+	{
+		fds[i] = OpenDedupe(frmap[i], i > 0);
+		if (fds[i] < 0 && i == 0)
+			return false;
+	}
+	
+	size_t argsz = sizeof(struct file_dedupe_range) + DEDUPE_FILES * sizeof(struct file_dedupe_range_info);
+	std::vector<char> argbuf(argsz);
+	struct file_dedupe_range *arg = (struct file_dedupe_range*)&argbuf[0];
+	
+	std::vector<int> left;
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (fds[i] >= 0)
+			left.push_back(i);
+	}
+	
+	bool supported = true;
+	std::vector<std::vector<int> > sets;
+	std::vector<int> same, differ;
+	while (supported && left.size() > 1)
+	{
+		int src = left[0];
+		same.assign(left.begin() + 1, left.end());
+		differ.clear();
+		
+		for (off_t offset = 0; supported && !same.empty() && offset < filesize; offset += DEDUPE_CHUNK)
+		{
+			off_t len = (filesize - offset < DEDUPE_CHUNK) ? filesize - offset : DEDUPE_CHUNK;
+			std::vector<int> next;
+			
+			for (size_t first = 0; supported && first < same.size(); first += DEDUPE_FILES)
+			{
+				size_t count = std::min(same.size() - first, (size_t)DEDUPE_FILES);
+				memset(arg, 0, argsz);
+				arg->src_offset = offset;
+				arg->src_length = len;
+				arg->dest_count = count;
+				for (size_t i = 0; i < count; ++i)
+				{
+					arg->info[i].dest_fd = fds[same[first + i]];
+					arg->info[i].dest_offset = offset;
+				}
+				
+				if (ioctl(fds[src], FIDEDUPERANGE, arg) < 0)
+				{
+					/* Not supported here (EOPNOTSUPP, EINVAL, or EXDEV across
+					 * mounts); anything deduplicated so far was identical,
+					 * so no harm is done by starting over */
+					supported = false;
+					break;
+				}
+				
+				Stats::Count(STAT_COMPARES, count);
+				for (size_t i = 0; i < count; ++i)
+				{
+					struct file_dedupe_range_info &info = arg->info[i];
+					int f = same[first + i];
+					if (info.status == FILE_DEDUPE_RANGE_DIFFERS)
+						differ.push_back(f);
+					else if (info.status < 0)
+					{
+						/* This file can't be deduplicated, and neither can
+						 * the rest; stop issuing requests, and leave them all
+						 * to be compared in the usual way */
+						supported = false;
+						break;
+					}
+					else
+					{
+						Stats::Count(STAT_COMPARE_BYTES, info.bytes_deduped);
+						__sync_fetch_and_add(&DedupeBytes, info.bytes_deduped);
+						
+						/* The kernel may stop short, such as at a partial
+						 * block before the end of the file; the rest is
+						 * compared here */
+						off_t done = info.bytes_deduped;
+						if (done >= len || SameRange(fds[src], fds[f], offset + done, len - done))
+							next.push_back(f);
+						else
+							differ.push_back(f);
+					}
+				}
+			}
+			
+			same.swap(next);
+		}
+		
+		if (!supported)
+			break;
+		
+		if (!same.empty())
+		{
+			same.insert(same.begin(), src);
+			std::sort(same.begin(), same.end());
+			sets.push_back(same);
+		}
+		
+		std::sort(differ.begin(), differ.end());
+		left.swap(differ);
+	}
+	
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	
+	if (!supported)
+		return false;
+	
+	/* Report sets in the order of their files in frmap, as CompareFiles does */
+	std::sort(sets.begin(), sets.end());
+	for (std::vector<std::vector<int> >::iterator it = sets.begin(); it != sets.end(); ++it)
+	{
+		results.push_back(DupeSet());
+		for (std::vector<int>::iterator fi = it->begin(); fi != it->end(); ++fi)
+			results.back().files.push_back(frmap[*fi]);
+	}
+	return true;
+}
+
+#else
+
+bool FastDup::CompareDeduped(FileReference **frmap, int fcount, off_t filesize, DupeSetList &results)
+{
+	return false;
+}
+
+#endif
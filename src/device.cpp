@@ -0,0 +1,225 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "device.h"
+#include <dirent.h>
+#include <limits.h>
+
+#ifdef __linux__
+# include <sys/sysmacros.h>
+#endif
+
+/* Mapped devices are followed down to their disk this many times at most */
+#define DISK_DEPTH 8
+
+/* Name of the disk that block device name is stored on */
+static std::string BlockDisk(const std::string &name, int depth = 0)
+{
+	std::string base = "/sys/class/block/" + name;
+	if (depth >= DISK_DEPTH)
+		return name;
+	
+	/* A partition is in the directory of its disk */
+	if (FileExists((base + "/partition").c_str()))
+	{
+		char link[PATH_MAX];
+		ssize_t len = readlink(base.c_str(), link, sizeof(link) - 1);
+		if (len <= 0)
+			return name;
+		link[len] = 0;
+		
+		char *slash = strrchr(link, '/');
+		if (!slash)
+			return name;
+		*slash = 0;
+		slash = strrchr(link, '/');
+		return BlockDisk(slash ? slash + 1 : link, depth + 1);
+	}
+	
+	/* A mapped device made of a single device is stored where that is; one
+	 * made of several (RAID) spreads its load itself */
+	DIR *d = opendir((base + "/slaves").c_str());
+	if (!d)
+		return name;
+	
+	std::string slave;
+	int count = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		slave = de->d_name;
+		count++;
+	}
+	closedir(d);
+	
+	return (count == 1) ? BlockDisk(slave, depth + 1) : name;
+}
+
+DeviceMap::DeviceMap()
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+DeviceMap::~DeviceMap()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+unsigned DeviceMap::Lane(dev_t dev)
+{
+	pthread_mutex_lock(&lock);
+	std::map<dev_t, unsigned>::iterator it = lanes.find(dev);
+	if (it != lanes.end())
+	{
+		unsigned re = it->second;
+		pthread_mutex_unlock(&lock);
+		return re;
+	}
+	
+	char key[PATH_MAX];
+	snprintf(key, sizeof(key), "%u:%u", major(dev), minor(dev));
+	std::string disk = key;
+	
+#ifdef __linux__
+	/* Filesystems that aren't on a block device have major number 0 */
+	char link[PATH_MAX];
+	ssize_t len = readlink((std::string("/sys/dev/block/") + key).c_str(), link, sizeof(link) - 1);
+	if (major(dev) && len > 0)
+	{
+		link[len] = 0;
+		char *slash = strrchr(link, '/');
+		disk = BlockDisk(slash ? slash + 1 : link);
+	}
+#endif
+	
+	std::map<std::string, unsigned>::iterator dit = disks.find(disk);
+	unsigned re;
+	if (dit != disks.end())
+		re = dit->second;
+	else
+	{
+		re = disks.size();
+		disks[disk] = re;
+	}
+	lanes[dev] = re;
+	
+	pthread_mutex_unlock(&lock);
+	return re;
+}
+
+unsigned DeviceMap::Count()
+{
+	pthread_mutex_lock(&lock);
+	unsigned re = disks.size();
+	pthread_mutex_unlock(&lock);
+	return re;
+}
+
+void MountPoints(std::vector<std::string> &points)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return;
+	
+	/* The mount point is the fifth field, with spaces and other special
+	 * characters escaped as \ooo */
+	char line[PATH_MAX * 2];
+	while (fgets(line, sizeof(line), f))
+	{
+		char *p = line;
+		for (int i = 0; i < 4 && p; ++i)
+		{
+			p = strchr(p, ' ');
+			if (p)
+				p++;
+		}
+		if (!p)
+			continue;
+		
+		std::string point;
+		for (; *p && *p != ' ' && *p != '\n'; ++p)
+		{
+			if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' && p[2] >= '0' && p[2] <= '7' && p[3] >= '0' && p[3] <= '7')
+			{
+				point += (char)(((p[1] - '0') << 6) | ((p[2] - '0') << 3) | (p[3] - '0'));
+				p += 3;
+			}
+			else
+				point += *p;
+		}
+		points.push_back(point);
+	}
+	fclose(f);
+#else
+	(void)points;
+#endif
+}
+
+void LaneQueue::Assign(const std::vector<unsigned> &lanes)
+{
+	items.clear();
+	for (size_t i = 0; i < lanes.size(); ++i)
+	{
+		if (lanes[i] >= items.size())
+			items.resize(lanes[i] + 1);
+		items[lanes[i]].push_back(i);
+	}
+	next.assign(items.size(), 0);
+}
+
+bool LaneQueue::Next(unsigned lane, size_t *item)
+{
+	size_t n = __sync_fetch_and_add(&next[lane], 1);
+	if (n >= items[lane].size())
+		return false;
+	*item = items[lane][n];
+	return true;
+}
+
+void RunLanes(const LaneQueue &queue, unsigned depth, void *(*fn)(void*), void *state)
+{
+	std::vector<LaneThread> args;
+	for (unsigned lane = 0; lane < queue.Lanes(); ++lane)
+	{
+		size_t count = (queue.Size(lane) < depth) ? queue.Size(lane) : depth;
+		for (size_t i = 0; i < count; ++i)
+		{
+			LaneThread t = { state, lane };
+			args.push_back(t);
+		}
+	}
+	
+	if (args.empty())
+		return;
+	
+	std::vector<pthread_t> pool(args.size());
+	for (size_t i = 1; i < args.size(); ++i)
+	{
+		if (pthread_create(&pool[i], NULL, fn, &args[i]) != 0)
+			throw std::runtime_error("Unable to create comparison thread");
+	}
+	
+	fn(&args[0]);
+	
+	for (size_t i = 1; i < args.size(); ++i)
+		pthread_join(pool[i], NULL);
+}
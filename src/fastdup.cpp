@@ -16,11 +16,17 @@
  */
 
 #include "main.h"
+#include "layout.h"
+#include "cache.h"
+#include "stats.h"
+#include <pthread.h>
+#include <algorithm>
 
 extern double scanstart;
 
 FastDup::FastDup()
-	: FileCount(0), CandidateSetCount(0), DupeFileCount(0), DupeSetCount(0), FileSizeTotal(0)
+	: Cache(NULL), CompareThreads(0), FileCount(0), CandidateSetCount(0), DupeFileCount(0), DupeSetCount(0), LinkFileCount(0), LinkSetCount(0),
+	  FileSizeTotal(0), DedupeBytes(0)
 {
 }
 
@@ -29,6 +35,22 @@ FastDup::~FastDup()
 	this->Cleanup();
 }
 
+size_t DirReference::Path(char *buf, size_t size) const
+{
+	size_t len = parent ? parent->Path(buf, size) : 0;
+	size_t namelen = strlcpy(buf + len, name, size - len);
+	if (len + namelen + 1 >= size)
+		throw std::runtime_error("Path too long for buffer");
+	
+	len += namelen;
+	if (!len || buf[len - 1] != '/')
+	{
+		buf[len++] = '/';
+		buf[len] = 0;
+	}
+	return len;
+}
+
 void FastDup::AddDirectoryTree(const char *path)
 {
 	std::string v = path;
@@ -54,52 +76,241 @@ void FastDup::AddDirectoryTree(const char *path)
 void FastDup::DoScanning(ErrorCallback errcb)
 {
 	scanstart = SSTime();
+	Stats::Phase(PHASE_SCAN);
+	
+	this->ScanTrees(errcb);
+	
+	Files.Group(CompareGroups, opt.watch);
+	for (SizeGroupList::iterator it = CompareGroups.begin(); it != CompareGroups.end(); ++it)
+	{
+		if (it->second->next)
+			CandidateSetCount++;
+	}
+}
+
+/* Size groups are independent of each other, so they are handed out to a
+ * pool of threads, each comparing one group at a time. The results of each
+ * group are reported under a lock, either as soon as the group is finished,
+ * or (when ordered) once every smaller group has been reported.
+ */
+struct FastDup::CompareState
+{
+	FastDup *dup;
+	DupeSetCallback dupecb, linkcb;
+	SizeGroupList groups;
+	/* Groups yet to be compared */
+	LaneQueue queue;
+	
+	/* Results of groups which can't be reported yet, and the index of the
+	 * next group to report, for ordered output */
+	std::vector<DupeSetList*> done;
+	size_t reported;
+	pthread_mutex_t lock;
+	
+	CompareState(FastDup *d, DupeSetCallback dcb, DupeSetCallback lcb)
+		: dup(d), dupecb(dcb), linkcb(lcb), reported(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+	}
 	
-	for (std::vector<std::string>::iterator it = DirList.begin(); it != DirList.end(); ++it)
-		this->ScanDirectory(it->c_str(), it->length(), NULL, errcb);
+	~CompareState()
+	{
+		pthread_mutex_destroy(&lock);
+	}
+};
+
+void *FastDup::CompareThread(void *arg)
+{
+	LaneThread *thread = static_cast<LaneThread*>(arg);
+	CompareState *state = static_cast<CompareState*>(thread->state);
+	FastDup *dup = state->dup;
+	
+	size_t gi;
+	while (state->queue.Next(thread->lane, &gi))
+	{
+		DupeSetList *results = new DupeSetList;
+		dup->Compare(state->groups[gi].second, state->groups[gi].first, *results);
+		
+		pthread_mutex_lock(&state->lock);
+		if (!dup->opt.ordered)
+		{
+			dup->ReportSets(*results, state->groups[gi].first, state->dupecb, state->linkcb);
+			delete results;
+		}
+		else
+		{
+			state->done[gi] = results;
+			for (; state->reported < state->groups.size() && state->done[state->reported]; state->reported++)
+			{
+				size_t ri = state->reported;
+				dup->ReportSets(*state->done[ri], state->groups[ri].first, state->dupecb, state->linkcb);
+				delete state->done[ri];
+				state->done[ri] = NULL;
+			}
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
 	
-	/* This technique was created by the developers of InspIRCd 
-	 * (http://www.inspircd.org) to allow deleting items from a STL
-	 * container while iterating over it. It has been tested on many
-	 * STL implementations without flaw. */
-	for (SizeRefMap::iterator it = FileSzMap.begin(), safeit; it != FileSzMap.end();)
+	return NULL;
+}
+
+void FastDup::ReportSets(DupeSetList &results, off_t filesize, DupeSetCallback dupecb, DupeSetCallback linkcb)
+{
+	for (DupeSetList::iterator it = results.begin(); it != results.end(); ++it)
 	{
-		if (!it->second->next)
+		if (it->linked)
 		{
-			safeit = it;
-			++it;
-			delete safeit->second;
-			FileSzMap.erase(safeit);
+			LinkSetCount++;
+			LinkFileCount += it->files.size();
+			if (linkcb)
+				linkcb(&it->files[0], it->files.size(), filesize);
 		}
 		else
-			++it;
+		{
+			DupeSetCount++;
+			DupeFileCount += it->files.size();
+			dupecb(&it->files[0], it->files.size(), filesize);
+		}
 	}
 }
 
-unsigned long FastDup::DoCompare(DupeSetCallback dupecb)
+struct GroupPosition
+{
+	dev_t dev;
+	PhysicalKey start;
+	size_t index;
+	
+	bool operator<(const GroupPosition &o) const
+	{
+		if (dev != o.dev)
+			return dev < o.dev;
+		if (start != o.start)
+			return start < o.start;
+		return index < o.index;
+	}
+};
+
+/* Order groups by where their first file is stored on disk, so that groups
+ * are compared in one sweep across the device rather than in size order */
+void FastDup::SortPhysical(SizeGroupList &groups)
+{
+	std::vector<GroupPosition> pos(groups.size());
+	for (size_t i = 0; i < groups.size(); ++i)
+	{
+		GroupPosition &gp = pos[i];
+		gp.dev = groups[i].second->dev;
+		gp.start = PhysicalStart(groups[i].second);
+		gp.index = i;
+		
+		for (FileReference *p = groups[i].second->next; p; p = p->next)
+		{
+			if (p->dev != gp.dev)
+				continue;
+			PhysicalKey start = PhysicalStart(p);
+			if (start < gp.start)
+				gp.start = start;
+		}
+	}
+	
+	std::sort(pos.begin(), pos.end());
+	
+	SizeGroupList sorted(groups.size());
+	for (size_t i = 0; i < pos.size(); ++i)
+		sorted[i] = groups[pos[i].index];
+	groups.swap(sorted);
+}
+
+unsigned long FastDup::DoCompare(DupeSetCallback dupecb, DupeSetCallback linkcb)
 {
 	DupeFileCount = DupeSetCount = 0;
+	LinkFileCount = LinkSetCount = 0;
+	DedupeBytes = 0;
 	
-	for (SizeRefMap::iterator i = FileSzMap.begin(); i != FileSzMap.end(); ++i)
+	if (opt.cachefile)
 	{
-		this->Compare(i->second, i->first, dupecb);
+		Cache = new CompareCache;
+		if (!opt.cachereset)
+			Cache->Load(opt.cachefile);
+	}
+	
+	Stats::Phase(PHASE_PREFILTER);
+	this->Prefilter(CompareGroups);
+	
+	Stats::Phase(PHASE_COMPARE);
+	if (opt.physical)
+		this->SortPhysical(CompareGroups);
+	
+	if (opt.threads <= 1 && !opt.devdepth)
+	{
+		DupeSetList results;
+		for (SizeGroupList::iterator i = CompareGroups.begin(); i != CompareGroups.end(); ++i)
+		{
+			results.clear();
+			this->Compare(i->second, i->first, results);
+			this->ReportSets(results, i->first, dupecb, linkcb);
+		}
+	}
+	else
+		this->CompareGroupsThreaded(dupecb, linkcb);
+	
+	if (Cache)
+	{
+		/* Files changed within this long before the scan might change again
+		 * without their times changing, on filesystems with coarse times */
+		unsigned long long cutoff = (unsigned long long)((scanstart - 2) * 1000000000ULL);
+		if (!Cache->Save(opt.cachefile, cutoff))
+			fprintf(stderr, "Unable to write cache file '%s': %s\n", opt.cachefile, strerror(errno));
+		delete Cache;
+		Cache = NULL;
 	}
 	
 	return DupeSetCount;
 }
 
+void FastDup::CompareGroupsThreaded(DupeSetCallback dupecb, DupeSetCallback linkcb)
+{
+	CompareState state(this, dupecb, linkcb);
+	state.groups = CompareGroups;
+	state.done.resize(state.groups.size(), NULL);
+	
+	unsigned depth = this->AssignLanes(state.groups, state.queue);
+	RunLanes(state.queue, depth, CompareThread, &state);
+}
+
+/* Queue groups for threads, each to the lane of the disk its first file is
+ * on, or all to one lane unless opt.devdepth is set. Returns the number of
+ * threads to give each lane, and counts them in CompareThreads. */
+unsigned FastDup::AssignLanes(const SizeGroupList &groups, LaneQueue &queue)
+{
+	std::vector<unsigned> lanes(groups.size(), 0);
+	if (opt.devdepth)
+	{
+		for (size_t i = 0; i < groups.size(); ++i)
+			lanes[i] = Devices.Lane(groups[i].second->dev);
+	}
+	queue.Assign(lanes);
+	
+	unsigned depth = opt.devdepth ? opt.devdepth : (opt.threads ? opt.threads : 1);
+	CompareThreads = 0;
+	for (unsigned lane = 0; lane < queue.Lanes(); ++lane)
+		CompareThreads += (queue.Size(lane) < depth) ? queue.Size(lane) : depth;
+	return depth;
+}
+
 void FastDup::Cleanup()
 {
-	for (SizeRefMap::iterator it = FileSzMap.begin(); it != FileSzMap.end(); ++it)
+	for (SizeGroupList::iterator it = CompareGroups.begin(); it != CompareGroups.end(); ++it)
 	{
 		for (FileReference *p = it->second, *np; p; p = np)
 		{
 			np = p->next;
-			delete p;
+			Files.Release(p);
 		}
 	}
 	
-	FileSzMap.clear();
+	CompareGroups.clear();
+	Files.Clear();
 	FileCount = CandidateSetCount = DupeFileCount = DupeSetCount = 0;
+	LinkFileCount = LinkSetCount = 0;
 	FileSizeTotal = 0;
 }
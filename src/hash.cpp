@@ -0,0 +1,173 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "hash.h"
+
+unsigned long long Hash64(const void *data, size_t len, unsigned long long seed)
+{
+	const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	unsigned long long h = seed ^ (len * m);
+	
+	const unsigned char *p = (const unsigned char*)data;
+	const unsigned char *end = p + (len & ~(size_t)7);
+	for (; p != end; p += 8)
+	{
+		unsigned long long k;
+		memcpy(&k, p, sizeof(k));
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+	
+	switch (len & 7)
+	{
+		case 7: h ^= (unsigned long long)p[6] << 48; /* fall through */
+		case 6: h ^= (unsigned long long)p[5] << 40; /* fall through */
+		case 5: h ^= (unsigned long long)p[4] << 32; /* fall through */
+		case 4: h ^= (unsigned long long)p[3] << 24; /* fall through */
+		case 3: h ^= (unsigned long long)p[2] << 16; /* fall through */
+		case 2: h ^= (unsigned long long)p[1] << 8; /* fall through */
+		case 1: h ^= (unsigned long long)p[0];
+			h *= m;
+	}
+	
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+static inline unsigned long long Rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long Fmix64(unsigned long long k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static const unsigned long long C1 = 0x87c37b91114253d5ULL;
+static const unsigned long long C2 = 0x4cf5ad432745937fULL;
+
+Hash128::Hash128(unsigned long long seed)
+	: h1(seed), h2(seed), total(0), taillen(0)
+{
+}
+
+void Hash128::Block(const unsigned char *p)
+{
+	unsigned long long k1, k2;
+	memcpy(&k1, p, sizeof(k1));
+	memcpy(&k2, p + 8, sizeof(k2));
+	
+	k1 *= C1;
+	k1 = Rotl64(k1, 31);
+	k1 *= C2;
+	h1 ^= k1;
+	h1 = Rotl64(h1, 27);
+	h1 += h2;
+	h1 = h1 * 5 + 0x52dce729;
+	
+	k2 *= C2;
+	k2 = Rotl64(k2, 33);
+	k2 *= C1;
+	h2 ^= k2;
+	h2 = Rotl64(h2, 31);
+	h2 += h1;
+	h2 = h2 * 5 + 0x38495ab5;
+}
+
+void Hash128::Update(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	total += len;
+	
+	if (taillen)
+	{
+		size_t n = (len < 16 - taillen) ? len : 16 - taillen;
+		memcpy(tail + taillen, p, n);
+		taillen += n;
+		p += n;
+		len -= n;
+		if (taillen < 16)
+			return;
+		this->Block(tail);
+		taillen = 0;
+	}
+	
+	for (; len >= 16; p += 16, len -= 16)
+		this->Block(p);
+	
+	memcpy(tail, p, len);
+	taillen = len;
+}
+
+void Hash128::Final(unsigned long long digest[2])
+{
+	unsigned long long k1 = 0, k2 = 0;
+	const unsigned char *p = tail;
+	
+	switch (taillen)
+	{
+		case 15: k2 ^= (unsigned long long)p[14] << 48; /* fall through */
+		case 14: k2 ^= (unsigned long long)p[13] << 40; /* fall through */
+		case 13: k2 ^= (unsigned long long)p[12] << 32; /* fall through */
+		case 12: k2 ^= (unsigned long long)p[11] << 24; /* fall through */
+		case 11: k2 ^= (unsigned long long)p[10] << 16; /* fall through */
+		case 10: k2 ^= (unsigned long long)p[9] << 8; /* fall through */
+		case 9: k2 ^= (unsigned long long)p[8];
+			k2 *= C2;
+			k2 = Rotl64(k2, 33);
+			k2 *= C1;
+			h2 ^= k2;
+			/* fall through */
+		case 8: k1 ^= (unsigned long long)p[7] << 56; /* fall through */
+		case 7: k1 ^= (unsigned long long)p[6] << 48; /* fall through */
+		case 6: k1 ^= (unsigned long long)p[5] << 40; /* fall through */
+		case 5: k1 ^= (unsigned long long)p[4] << 32; /* fall through */
+		case 4: k1 ^= (unsigned long long)p[3] << 24; /* fall through */
+		case 3: k1 ^= (unsigned long long)p[2] << 16; /* fall through */
+		case 2: k1 ^= (unsigned long long)p[1] << 8; /* fall through */
+		case 1: k1 ^= (unsigned long long)p[0];
+			k1 *= C1;
+			k1 = Rotl64(k1, 31);
+			k1 *= C2;
+			h1 ^= k1;
+	}
+	
+	unsigned long long a = h1 ^ total, b = h2 ^ total;
+	a += b;
+	b += a;
+	a = Fmix64(a);
+	b = Fmix64(b);
+	a += b;
+	b += a;
+	
+	digest[0] = a;
+	digest[1] = b;
+}
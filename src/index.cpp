@@ -0,0 +1,260 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "index.h"
+#include <new>
+
+/* References in each block */
+#define FILE_BLOCK 4096
+/* Bytes in each block of an arena */
+#define ARENA_BLOCK 65536
+
+Arena::Arena()
+	: used(ARENA_BLOCK)
+{
+}
+
+Arena::~Arena()
+{
+	this->Clear();
+}
+
+void *Arena::Alloc(size_t len, size_t align)
+{
+	used = (used + align - 1) & ~(align - 1);
+	if (used + len > ARENA_BLOCK)
+	{
+		/* Anything too big to share a block gets one of its own, before the
+		 * current block so that it can still be filled */
+		if (len > ARENA_BLOCK / 4)
+		{
+			char *mem = static_cast<char*>(operator new(len));
+			blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), mem);
+			return mem;
+		}
+		blocks.push_back(static_cast<char*>(operator new(ARENA_BLOCK)));
+		used = 0;
+	}
+	
+	void *re = blocks.back() + used;
+	used += len;
+	return re;
+}
+
+const char *Arena::Store(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *re = static_cast<char*>(this->Alloc(len));
+	memcpy(re, str, len);
+	return re;
+}
+
+void Arena::Merge(Arena &other)
+{
+	/* The rest of our last block is wasted, but the other's can be used */
+	if (!other.blocks.empty())
+	{
+		blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+		used = other.used;
+	}
+	other.blocks.clear();
+	other.used = ARENA_BLOCK;
+}
+
+void Arena::Clear()
+{
+	for (std::vector<char*>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+		operator delete(*it);
+	blocks.clear();
+	used = ARENA_BLOCK;
+}
+
+FileIndex::FileIndex()
+	: used(FILE_BLOCK)
+{
+}
+
+FileIndex::~FileIndex()
+{
+	this->Clear();
+}
+
+DirReference *FileIndex::AddDirectory(DirReference *parent, const char *name)
+{
+	void *mem = names.Alloc(sizeof(DirReference), sizeof(void*));
+	return new (mem) DirReference(parent, names.Store(name));
+}
+
+FileReference *FileIndex::Alloc(DirReference *dir, const char *name, dev_t dev, ino_t ino, unsigned long long mtime,
+                                unsigned long long ctime)
+{
+	void *mem;
+	if (!freed.empty())
+	{
+		mem = freed.back();
+		freed.pop_back();
+	}
+	else
+	{
+		if (used == FILE_BLOCK)
+		{
+			blocks.push_back(static_cast<char*>(operator new(FILE_BLOCK * sizeof(FileReference))));
+			used = 0;
+		}
+		mem = blocks.back() + used++ * sizeof(FileReference);
+	}
+	
+	return new (mem) FileReference(dir, name, dev, ino, mtime, ctime);
+}
+
+FileReference *FileIndex::Add(off_t size, DirReference *dir, const char *name, dev_t dev, ino_t ino,
+                              unsigned long long mtime, unsigned long long ctime)
+{
+	Entry e;
+	e.size = size;
+	e.file = this->Alloc(dir, names.Store(name), dev, ino, mtime, ctime);
+	entries.push_back(e);
+	return e.file;
+}
+
+void FileIndex::Release(FileReference *file)
+{
+	file->~FileReference();
+	freed.push_back(file);
+}
+
+void FileIndex::Merge(FileIndex &other)
+{
+	if (entries.empty())
+		entries.swap(other.entries);
+	else
+		entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+	freed.insert(freed.end(), other.freed.begin(), other.freed.end());
+	names.Merge(other.names);
+	
+	/* The rest of our last block is wasted, but the other's can be used */
+	if (!other.blocks.empty())
+	{
+		blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+		used = other.used;
+	}
+	
+	std::vector<Entry>().swap(other.entries);
+	other.blocks.clear();
+	other.freed.clear();
+	other.used = FILE_BLOCK;
+}
+
+/* Stable radix sort of the entries by size, a byte at a time from the
+ * lowest. Bytes that are the same in every size are skipped, which for the
+ * sizes of real files is most of them. */
+void FileIndex::SortBySize()
+{
+	size_t n = entries.size();
+	if (n < 2)
+		return;
+	
+	static const int BYTES = sizeof(off_t);
+	std::vector<size_t> counts(BYTES * 256, 0);
+	for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+	{
+		unsigned long long v = it->size;
+		for (int b = 0; b < BYTES; ++b, v >>= 8)
+			counts[b * 256 + (v & 0xff)]++;
+	}
+	
+	std::vector<Entry> sorted(n);
+	for (int b = 0; b < BYTES; ++b)
+	{
+		size_t *count = &counts[b * 256];
+		int shift = b * 8;
+		if (count[((unsigned long long)entries[0].size >> shift) & 0xff] == n)
+			continue;
+		
+		size_t pos[256];
+		size_t total = 0;
+		for (int d = 0; d < 256; ++d)
+		{
+			pos[d] = total;
+			total += count[d];
+		}
+		
+		for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+			sorted[pos[((unsigned long long)it->size >> shift) & 0xff]++] = *it;
+		entries.swap(sorted);
+	}
+}
+
+void FileIndex::Group(std::vector<std::pair<off_t, FileReference*> > &groups, bool keepsingle)
+{
+	this->SortBySize();
+	
+	/* When files are dropped, the rest are copied out of the old blocks so
+	 * that those can be freed */
+	std::vector<char*> old;
+	if (!keepsingle)
+	{
+		old.swap(blocks);
+		used = FILE_BLOCK;
+		freed.clear();
+	}
+	
+	for (size_t i = 0, j; i < entries.size(); i = j)
+	{
+		off_t size = entries[i].size;
+		for (j = i + 1; j < entries.size() && entries[j].size == size; ++j)
+			;
+		
+		if (j - i == 1 && !keepsingle)
+		{
+			entries[i].file->~FileReference();
+			continue;
+		}
+		
+		FileReference *head = NULL, **tail = &head;
+		for (size_t k = i; k < j; ++k)
+		{
+			FileReference *p = entries[k].file;
+			if (!keepsingle)
+			{
+				FileReference *copy = this->Alloc(p->dir, p->file, p->dev, p->ino, p->mtime, p->ctime);
+				p->~FileReference();
+				p = copy;
+			}
+			*tail = p;
+			tail = &p->next;
+		}
+		groups.push_back(std::make_pair(size, head));
+	}
+	
+	for (std::vector<char*>::iterator it = old.begin(); it != old.end(); ++it)
+		operator delete(*it);
+	std::vector<Entry>().swap(entries);
+}
+
+void FileIndex::Clear()
+{
+	for (std::vector<char*>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+		operator delete(*it);
+	blocks.clear();
+	freed.clear();
+	names.Clear();
+	std::vector<Entry>().swap(entries);
+	used = FILE_BLOCK;
+}
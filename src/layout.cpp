@@ -0,0 +1,110 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "layout.h"
+#include "stats.h"
+#include <fcntl.h>
+
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
+
+void FileLayout::Load(int fd, ino_t ino, bool first)
+{
+	extents.clear();
+	fallback = ino;
+
+#ifdef FS_IOC_FIEMAP
+	/* Extents are fetched in batches, until the last one is seen */
+	const unsigned batch = first ? 1 : 64;
+	char fmbuf[sizeof(struct fiemap) + batch * sizeof(struct fiemap_extent)];
+	struct fiemap *fm = (struct fiemap*)fmbuf;
+	unsigned long long start = 0;
+
+	for (;;)
+	{
+		memset(fm, 0, sizeof(struct fiemap));
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET;
+		fm->fm_extent_count = batch;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || !fm->fm_mapped_extents)
+			break;
+
+		bool last = false;
+		for (unsigned i = 0; i < fm->fm_mapped_extents; ++i)
+		{
+			struct fiemap_extent &fe = fm->fm_extents[i];
+			/* Data that isn't at a known location, such as inline or delayed
+			 * allocation, says nothing useful about where to seek */
+			if (!(fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+			{
+				Extent e = { fe.fe_logical, fe.fe_physical, fe.fe_length };
+				extents.push_back(e);
+			}
+			start = fe.fe_logical + fe.fe_length;
+			if (fe.fe_flags & FIEMAP_EXTENT_LAST)
+				last = true;
+		}
+
+		if (last || first)
+			break;
+	}
+#else
+	(void)fd;
+	(void)first;
+#endif
+}
+
+PhysicalKey FileLayout::Physical(off_t offset) const
+{
+	if (extents.empty())
+		return PhysicalKey(1, fallback);
+
+	/* Find the last extent starting at or before offset */
+	size_t lo = 0, hi = extents.size();
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (extents[mid].logical <= (unsigned long long)offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	const Extent &e = extents[lo];
+	if ((unsigned long long)offset < e.logical)
+		return PhysicalKey(0, e.physical);
+	return PhysicalKey(0, e.physical + ((unsigned long long)offset - e.logical));
+}
+
+PhysicalKey PhysicalStart(FileReference *file)
+{
+	FileLayout layout;
+	char path[PATH_MAX];
+	int fd = CountedOpen(file->Path(path, sizeof(path)), O_RDONLY);
+	if (fd < 0)
+		return PhysicalKey(1, file->ino);
+
+	layout.Load(fd, file->ino, true);
+	close(fd);
+	return layout.Physical(0);
+}
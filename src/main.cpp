@@ -17,24 +17,56 @@
  */
 
 #include "main.h"
+#include "stats.h"
+#include "output.h"
 #include <getopt.h>
 #include <limits.h>
 
 bool Interactive = false;
+FILE *Messages = stdout;
 
 static bool FileErrors = false;
 static off_t FileSzWasted = 0;
+/* File to write counters of the run to, or NULL */
+static const char *StatsFile = NULL;
+static OutputFormat Format = OUTPUT_TEXT;
+/* Writes sets to stdout, for formats other than text */
+static SetWriter *Writer = NULL;
 
 static void ShowHelp(const char *bin);
 static void DuplicateSet(FileReference *files[], unsigned long fcount, off_t filesize);
+static void LinkedSet(FileReference *files[], unsigned long fcount, off_t filesize);
 static bool ScanTreeError(const char *path, const char *error);
 
+static void WriteSet(FileReference *files[], unsigned long fcount, off_t filesize, bool linked)
+{
+	/* Nothing else is worth doing once the reader has gone away */
+	if (!Writer->Write(files, fcount, filesize, linked))
+	{
+		fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void WriteStats(const FastDup &dupi, double seconds)
+{
+	if (StatsFile && !Stats::Write(StatsFile, dupi, seconds))
+		fprintf(stderr, "Unable to write stats file '%s': %s\n", StatsFile, strerror(errno));
+}
+
 static int ReadOptions(int argc, char **argv, DupOptions &dopt)
 {
 	Interactive = isatty(fileno(stdout));
 	
-	char opt;
-	while ((opt = getopt(argc, argv, "ibhc:")) >= 0)
+	static const struct option longopts[] =
+	{
+		{ "stats", required_argument, NULL, 'S' },
+		{ "json", no_argument, NULL, 'J' },
+		{ NULL, 0, NULL, 0 }
+	};
+	
+	int opt;
+	while ((opt = getopt_long(argc, argv, "ibhc:j:d:xUue:O:PF:C:IWH:V0D", longopts, NULL)) >= 0)
 	{
 		switch (opt)
 		{
@@ -54,6 +86,117 @@ static int ReadOptions(int argc, char **argv, DupOptions &dopt)
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'j':
+			{
+				char *serr;
+				unsigned long threads = strtoul(optarg, &serr, 10);
+				if (*serr != '\0' || !threads || threads > 1024)
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -j\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				dopt.threads = threads;
+				break;
+			}
+			case 'd':
+			{
+				char *serr;
+				unsigned long depth = strtoul(optarg, &serr, 10);
+				if (*serr != '\0' || !depth || depth > 1024)
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -d\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				dopt.devdepth = depth;
+				break;
+			}
+			case 'x':
+				dopt.onefs = true;
+				break;
+			case 'U':
+				dopt.uring = true;
+				break;
+			case 'e':
+				if (!strcmp(optarg, "read"))
+					dopt.engine = ENGINE_READ;
+				else if (!strcmp(optarg, "uring"))
+					dopt.engine = ENGINE_URING;
+				else if (!strcmp(optarg, "mmap"))
+					dopt.engine = ENGINE_MMAP;
+				else
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -e\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'O':
+				if (!strcmp(optarg, "cache"))
+					dopt.iopolicy = IO_CACHED;
+				else if (!strcmp(optarg, "drop"))
+					dopt.iopolicy = IO_DONTNEED;
+				else if (!strcmp(optarg, "direct"))
+					dopt.iopolicy = IO_DIRECT;
+				else
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -O\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'u':
+				dopt.ordered = false;
+				break;
+			case 'P':
+				dopt.physical = true;
+				break;
+			case 'C':
+				dopt.cachefile = optarg;
+				break;
+			case 'I':
+				dopt.cachereset = true;
+				break;
+			case 'W':
+				dopt.watch = true;
+				break;
+			case 'H':
+			{
+				char *serr;
+				unsigned long files = strtoul(optarg, &serr, 10);
+				if (*serr != '\0' || files < 2)
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -H\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				dopt.hashmin = files;
+				break;
+			}
+			case 'V':
+				dopt.verify = true;
+				break;
+			case 'D':
+				dopt.dedupe = true;
+				break;
+			case 'S':
+				StatsFile = optarg;
+				Stats::enabled = true;
+				break;
+			case 'J':
+				Format = OUTPUT_JSON;
+				break;
+			case '0':
+				Format = OUTPUT_NUL;
+				break;
+			case 'F':
+			{
+				char *serr;
+				unsigned long limit = strtoul(optarg, &serr, 10);
+				if (*serr != '\0' || limit < 2)
+				{
+					fprintf(stderr, "Error: Invalid argument '%s' to option -F\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				dopt.fdlimit = limit;
+				break;
+			}
 			case 'h':
 			default:
 				ShowHelp(argv[0]);
@@ -68,6 +211,18 @@ static int ReadOptions(int argc, char **argv, DupOptions &dopt)
 		exit(EXIT_FAILURE);
 	}
 	
+	/* Sets are reported as files change, with nobody there to answer */
+	if (dopt.watch)
+		Interactive = false;
+	
+	/* Sets are read by another program, which can't answer either */
+	if (Format != OUTPUT_TEXT)
+	{
+		Interactive = false;
+		Messages = stderr;
+		Writer = new SetWriter(fileno(stdout), Format);
+	}
+	
 	return optind;
 }
 
@@ -80,6 +235,17 @@ int main(int argc, char **argv)
 	for (int i = pi; i < argc; ++i)
 		dupi.AddDirectoryTree(argv[i]);
 	
+	if (dupi.opt.watch)
+	{
+		fprintf(Messages, "Scanning for files...\n");
+		if (!dupi.Watch(ScanTreeError, DuplicateSet, LinkedSet))
+		{
+			fprintf(stderr, "Unable to watch for changes: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	
 	/* Initial scan - this step will recurse through the directory tree(s)
 	 * and find each file we will be working with. These files are mapped
 	 * by their size as this process runs through, so we will be provided
@@ -92,7 +258,7 @@ int main(int argc, char **argv)
 		fflush(stdout);
 	}
 	else
-		printf("Scanning for files...\n");
+		fprintf(Messages, "Scanning for files...\n");
 	
 	double starttm = SSTime();
 	dupi.DoScanning(ScanTreeError);
@@ -102,7 +268,8 @@ int main(int argc, char **argv)
 	
 	if (!dupi.FileCount)
 	{
-		printf("\nNo files found!\n");
+		fprintf(Messages, "\nNo files found!\n");
+		WriteStats(dupi, endtm - starttm);
 		return EXIT_SUCCESS;
 	}
 	
@@ -112,14 +279,22 @@ int main(int argc, char **argv)
 			return EXIT_FAILURE;
 	}
 	
-	printf("Comparing %lu set%s of files...\n\n", dupi.CandidateSetCount, (dupi.CandidateSetCount != 1) ? "s" : "");
+	fprintf(Messages, "Comparing %lu set%s of files...\n\n", dupi.CandidateSetCount, (dupi.CandidateSetCount != 1) ? "s" : "");
+	fflush(Messages);
 	
-	dupi.DoCompare(DuplicateSet);
+	dupi.DoCompare(DuplicateSet, LinkedSet);
 	endtm = SSTime();
 	
-	printf("Found %lu duplicate%s of %lu file%s (%sB wasted)\n", dupi.DupeFileCount - dupi.DupeSetCount, (dupi.DupeFileCount - dupi.DupeSetCount != 1) ? "s" : "", dupi.DupeSetCount,
+	fprintf(Messages, "Found %lu duplicate%s of %lu file%s (%sB wasted)\n", dupi.DupeFileCount - dupi.DupeSetCount, (dupi.DupeFileCount - dupi.DupeSetCount != 1) ? "s" : "", dupi.DupeSetCount,
 		(dupi.DupeSetCount != 1) ? "s" : "", ByteSizes(FileSzWasted).c_str());
-	printf("Scanned %lu file%s (%sB) in %.3f seconds\n", dupi.FileCount, (dupi.FileCount != 1) ? "s" : "", ByteSizes(dupi.FileSizeTotal).c_str(), endtm - starttm);
+	if (dupi.DedupeBytes)
+		fprintf(Messages, "Shared %sB of duplicate data between files\n", ByteSizes(dupi.DedupeBytes).c_str());
+	if (dupi.LinkSetCount)
+		fprintf(Messages, "Found %lu hardlink%s to %lu file%s (already linked)\n", dupi.LinkFileCount - dupi.LinkSetCount,
+			(dupi.LinkFileCount - dupi.LinkSetCount != 1) ? "s" : "", dupi.LinkSetCount, (dupi.LinkSetCount != 1) ? "s" : "");
+	fprintf(Messages, "Scanned %lu file%s (%sB) in %.3f seconds\n", dupi.FileCount, (dupi.FileCount != 1) ? "s" : "", ByteSizes(dupi.FileSizeTotal).c_str(), endtm - starttm);
+	
+	WriteStats(dupi, endtm - starttm);
 	
 	dupi.Cleanup();
 	
@@ -139,6 +314,13 @@ bool ScanTreeError(const char *path, const char *error)
 void DuplicateSet(FileReference *files[], unsigned long fcount, off_t filesize)
 {
 	FileSzWasted += filesize * (fcount-1);
+	if (Writer)
+	{
+		WriteSet(files, fcount, filesize, false);
+		return;
+	}
+	
+	char path[PATH_MAX];
 	
 	printf("%lu files (%sB/ea)\n", fcount, ByteSizes(filesize).c_str());
 
@@ -150,9 +332,9 @@ void DuplicateSet(FileReference *files[], unsigned long fcount, off_t filesize)
 	for (unsigned long i = 0; i < fcount; ++i)
 	{
 		if (Interactive)
-			printf("\t[%lu]\t%s\n", i, files[i]->FullPath());
+			printf("\t[%lu]\t%s\n", i, files[i]->Path(path, sizeof(path)));
 		else
-			printf("\t%s\n", files[i]->FullPath());
+			printf("\t%s\n", files[i]->Path(path, sizeof(path)));
 	}
 
 	if (Interactive)
@@ -190,6 +372,27 @@ ask:
 	printf("\n");
 }
 
+/* Hardlinks to the same file; these waste no space and can't be deduplicated
+ * any further, so they're reported for information only */
+void LinkedSet(FileReference *files[], unsigned long fcount, off_t filesize)
+{
+	/* There's nothing to be done with these from a list of paths alone */
+	if (Writer)
+	{
+		if (Format == OUTPUT_JSON)
+			WriteSet(files, fcount, filesize, true);
+		return;
+	}
+	
+	char path[PATH_MAX];
+	printf("%lu files (%sB/ea, already linked)\n", fcount, ByteSizes(filesize).c_str());
+	
+	for (unsigned long i = 0; i < fcount; ++i)
+		printf("\t%s\n", files[i]->Path(path, sizeof(path)));
+	
+	printf("\n");
+}
+
 static void ShowHelp(const char *bin)
 {
 	printf(
@@ -198,9 +401,51 @@ static void ShowHelp(const char *bin)
 		"Options:\n"
 		"    -c [+-=]1[gmkb]             File conditions; size is greater (+), less (-), or\n"
 		"                                    equal (=)\n"
+		"    -j threads                  Number of threads used to scan and compare files\n"
+		"    -d threads                  Give each disk this many threads of its own to scan\n"
+		"                                    and compare files with, instead of -j\n"
+		"    -x                          Don't descend into other filesystems\n"
+		"    -u                          Report duplicates as soon as they are found, rather\n"
+		"                                    than in order of size (with -j)\n"
+		"    -U                          Use io_uring to batch file metadata lookups (Linux)\n"
+		"    -e read|uring|mmap          Method of reading files for comparison; uring\n"
+		"                                    overlaps reads with comparison (Linux), mmap\n"
+		"                                    compares in place, best for cached files\n"
+		"    -O cache|drop|direct        What to leave in the page cache; drop removes files\n"
+		"                                    from it once read, direct reads around it\n"
+		"                                    (Linux), so other programs keep their data\n"
+		"                                    cached (default: cache)\n"
+		"    -P                          Schedule reads by physical disk location, for\n"
+		"                                    spinning disks (Linux)\n"
+		"    -F files                    Most files to keep open at once when comparing\n"
+		"                                    (default: from the open file limit)\n"
+		"    -C file                     Remember what was learned about files in file, so\n"
+		"                                    that unchanged files are read less next time\n"
+		"    -I                          Discard what the cache file holds, and rebuild it\n"
+		"    -H files                    Compare sets of more than this many files by hashing\n"
+		"                                    each file whole, one at a time; best when most\n"
+		"                                    are duplicates. Without -V, files with the same\n"
+		"                                    hash are reported without being compared, so a\n"
+		"                                    hash collision would report files that differ\n"
+		"    -V                          With -H, compare files byte by byte after hashing\n"
+		"    -D                          Have the filesystem compare duplicates, and share\n"
+		"                                    their data so that it is only stored once\n"
+		"                                    (btrfs, XFS; Linux)\n"
+		"    -W                          Keep running, and report new duplicates as files\n"
+		"                                    are created and changed (Linux; implies -b)\n"
+		"    --stats=file                Write counters of calls, bytes read, comparisons\n"
+		"                                    and latencies of each phase to file, as JSON\n"
+		"    --json                      Write each set of files as a JSON object, one per\n"
+		"                                    line, as soon as it is found (implies -b)\n"
+		"    -0                          Write the paths of each set followed by NUL, and\n"
+		"                                    each set by another NUL (implies -b)\n"
 		"    -i                          Enable interactive prompts (default on terminals)\n"
 		"    -b                          Disable interactive prompts (batch mode)\n"
 		"    -h                          Show help and options\n"
+		"\n"
+		"Paths that are hardlinks to one file are listed as a set of their own, marked\n"
+		"\"already linked\" (\"linked\":true with --json, left out with -0), and are not\n"
+		"counted as duplicates; earlier versions listed them among the duplicates.\n"
 		"\n", bin
 	);
 }
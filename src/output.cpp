@@ -0,0 +1,165 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "output.h"
+
+/* Size the buffer starts out with; it grows to fit the largest set */
+#define OUTPUT_BUFFER (1024 * 1024)
+
+SetWriter::SetWriter(int f, OutputFormat fmt)
+	: fd(f), format(fmt), buf(OUTPUT_BUFFER), len(0)
+{
+}
+
+char *SetWriter::Reserve(size_t n)
+{
+	if (len + n > buf.size())
+		buf.resize((len + n) * 2);
+	return &buf[len];
+}
+
+void SetWriter::Append(const char *s, size_t n)
+{
+	memcpy(Reserve(n), s, n);
+	len += n;
+}
+
+/* Length of the valid UTF-8 sequence at s, or 0 if there isn't one */
+static size_t Utf8Length(const unsigned char *s)
+{
+	size_t n;
+	unsigned min;
+	unsigned c = s[0];
+	if (c < 0xc2)
+		return 0;
+	else if (c < 0xe0)
+		n = 2, min = 0x80, c &= 0x1f;
+	else if (c < 0xf0)
+		n = 3, min = 0x800, c &= 0x0f;
+	else if (c < 0xf5)
+		n = 4, min = 0x10000, c &= 0x07;
+	else
+		return 0;
+	
+	for (size_t i = 1; i < n; ++i)
+	{
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+	
+	/* Overlong forms, surrogates, and anything past U+10FFFF */
+	if (c < min || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+		return 0;
+	return n;
+}
+
+void SetWriter::AppendString(const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *s = (const unsigned char*)str;
+	
+	Append("\"", 1);
+	while (*s)
+	{
+		/* Escapes are at most 6 bytes for each byte of the path */
+		char *p = Reserve(6), *start = p;
+		unsigned c = *s;
+		if (c == '"' || c == '\\')
+		{
+			*p++ = '\\';
+			*p++ = c;
+			s++;
+		}
+		else if (c < 0x20)
+		{
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 15];
+			p += 6;
+			s++;
+		}
+		else if (c < 0x80)
+		{
+			*p++ = c;
+			s++;
+		}
+		else if (size_t n = Utf8Length(s))
+		{
+			memcpy(p, s, n);
+			p += n;
+			s += n;
+		}
+		else
+		{
+			memcpy(p, "\\udc", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 15];
+			p += 6;
+			s++;
+		}
+		len += p - start;
+	}
+	Append("\"", 1);
+}
+
+bool SetWriter::Write(FileReference *files[], unsigned long count, off_t filesize, bool linked)
+{
+	len = 0;
+	
+	if (format == OUTPUT_JSON)
+	{
+		char head[64];
+		int n = snprintf(head, sizeof(head), "{\"size\":%llu,\"linked\":%s,\"files\":[", (unsigned long long)filesize,
+		                 linked ? "true" : "false");
+		Append(head, n);
+		
+		char path[PATH_MAX];
+		for (unsigned long i = 0; i < count; ++i)
+		{
+			if (i)
+				Append(",", 1);
+			AppendString(files[i]->Path(path, sizeof(path)));
+		}
+		Append("]}\n", 3);
+	}
+	else
+	{
+		for (unsigned long i = 0; i < count; ++i)
+		{
+			/* Paths are built straight into the buffer */
+			files[i]->Path(Reserve(PATH_MAX), PATH_MAX);
+			len += strlen(&buf[len]) + 1;
+		}
+		Append("", 1);
+	}
+	
+	for (size_t done = 0; done < len;)
+	{
+		ssize_t r = write(fd, &buf[done], len - done);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += r;
+	}
+	return true;
+}
@@ -0,0 +1,265 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "hash.h"
+#include "cache.h"
+#include "stats.h"
+#include "reader.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <algorithm>
+
+/* Before any group is compared in full, a few cheap passes are made over
+ * all of them, each reading a small sample of every file: the start, then
+ * the end, then a few places spread through the middle. Each group is split
+ * by a hash of those samples. Same-sized files often share their first
+ * blocks (logs, disk images, media with identical headers) but differ
+ * elsewhere, and these are told apart with a few small reads rather than
+ * by reading them in sequence up to the first difference.
+ *
+ * A hash collision only means that two files are left in the same group,
+ * where Compare still checks every byte; the prefilter can never cause two
+ * different files to be reported as duplicates.
+ */
+
+#define SAMPLE_SIZE 4096
+/* Files smaller than this are left to Compare, which reads their start
+ * first anyway, and for which the samples would be most of the file */
+#define PREFILTER_MIN (16 * SAMPLE_SIZE)
+/* Number of samples taken from the middle of each file */
+#define MIDDLE_SAMPLES 3
+
+enum PrefilterPass
+{
+	PASS_HEAD,
+	PASS_TAIL,
+	PASS_MIDDLE,
+	PASS_COUNT
+};
+
+struct FastDup::PrefilterState
+{
+	FastDup *dup;
+	SizeGroupList *groups;
+	PrefilterPass pass;
+	/* Groups yet to be hashed */
+	LaneQueue queue;
+	/* Sample hash of each file in each group, in list order; empty for groups
+	 * that are not to be split in this pass */
+	std::vector<std::vector<unsigned long long> > keys;
+};
+
+/* Samples are too small and scattered to be read directly, so with any
+ * policy but IO_CACHED, they are dropped from the cache after reading */
+static bool ReadSample(int fd, char *buf, off_t offset, IoPolicy policy)
+{
+	return ReadForCompare(fd, buf, SAMPLE_SIZE, offset, (policy == IO_CACHED) ? IO_CACHED : IO_DONTNEED) == SAMPLE_SIZE;
+}
+
+/* Hash the samples of a file for a pass. Returns false if the file could
+ * not be read as expected. */
+static bool HashSamples(FileReference *file, off_t filesize, PrefilterPass pass, IoPolicy policy, unsigned long long *key)
+{
+	char path[PATH_MAX];
+	int fd = CountedOpen(file->Path(path, sizeof(path)), O_RDONLY);
+	if (fd < 0)
+		return false;
+	
+	char buf[SAMPLE_SIZE];
+	bool ok = true;
+	switch (pass)
+	{
+		case PASS_HEAD:
+			ok = ReadSample(fd, buf, 0, policy);
+			*key = Hash64(buf, SAMPLE_SIZE);
+			break;
+		case PASS_TAIL:
+			ok = ReadSample(fd, buf, filesize - SAMPLE_SIZE, policy);
+			*key = Hash64(buf, SAMPLE_SIZE);
+			break;
+		default:
+			*key = 0;
+			for (int i = 1; ok && i <= MIDDLE_SAMPLES; ++i)
+			{
+				off_t offset = filesize / (MIDDLE_SAMPLES + 1) * i;
+				offset -= offset % SAMPLE_SIZE;
+				ok = ReadSample(fd, buf, offset, policy);
+				*key = Hash64(buf, SAMPLE_SIZE, *key);
+			}
+			break;
+	}
+	
+#ifdef POSIX_FADV_DONTNEED
+	/* Along with whatever was read ahead of the samples */
+	if (policy != IO_CACHED)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fd);
+	return ok;
+}
+
+/* Orders files by inode, so that the paths of each one are together */
+struct InodeOrder
+{
+	const std::vector<FileReference*> &files;
+	
+	InodeOrder(const std::vector<FileReference*> &f) : files(f) { }
+	
+	bool operator()(size_t a, size_t b) const
+	{
+		const FileReference *fa = files[a], *fb = files[b];
+		return (fa->dev < fb->dev) || (fa->dev == fb->dev && fa->ino < fb->ino);
+	}
+};
+
+static bool SameInode(const FileReference *a, const FileReference *b)
+{
+	return a->dev == b->dev && a->ino == b->ino;
+}
+
+void *FastDup::PrefilterThread(void *arg)
+{
+	LaneThread *thread = static_cast<LaneThread*>(arg);
+	PrefilterState *state = static_cast<PrefilterState*>(thread->state);
+	CompareCache *cache = state->dup->Cache;
+	
+	size_t gi;
+	std::vector<FileReference*> files;
+	std::vector<size_t> order;
+	while (state->queue.Next(thread->lane, &gi))
+	{
+		std::pair<off_t,FileReference*> &group = (*state->groups)[gi];
+		if (group.first < PREFILTER_MIN || !group.second->next)
+			continue;
+		
+		/* Hardlinks are sampled once, through their first path, as Compare
+		 * reads them */
+		files.clear();
+		for (FileReference *p = group.second; p; p = p->next)
+			files.push_back(p);
+		order.resize(files.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), InodeOrder(files));
+		
+		/* All of them are links to the same file */
+		if (SameInode(files[order.front()], files[order.back()]))
+			continue;
+		
+		std::vector<unsigned long long> &keys = state->keys[gi];
+		keys.resize(files.size());
+		for (size_t i = 0, j; i < order.size(); i = j)
+		{
+			FileReference *p = files[order[i]];
+			unsigned long long key;
+			if (!cache || !cache->Sample(p, group.first, state->pass, &key))
+			{
+				if (!HashSamples(p, group.first, state->pass, state->dup->opt.iopolicy, &key))
+				{
+					/* Leave the group as it is, so that Compare deals with
+					 * the file in the usual way */
+					keys.clear();
+					break;
+				}
+				
+				if (cache)
+					cache->SetSample(p, group.first, state->pass, key);
+			}
+			
+			for (j = i; j < order.size() && SameInode(files[order[j]], p); ++j)
+				keys[order[j]] = key;
+		}
+	}
+	
+	return NULL;
+}
+
+struct SampleOrder
+{
+	const std::vector<unsigned long long> &keys;
+	
+	SampleOrder(const std::vector<unsigned long long> &k) : keys(k) { }
+	
+	bool operator()(size_t a, size_t b) const
+	{
+		return keys[a] < keys[b];
+	}
+};
+
+/* Split a group into lists of files with equal keys, in the order of their
+ * first file. Files left on their own can't have duplicates, and are freed. */
+static void SplitGroup(FileIndex &index, off_t filesize, FileReference *first,
+                       const std::vector<unsigned long long> &keys, std::vector<std::pair<off_t,FileReference*> > &out)
+{
+	std::vector<FileReference*> files;
+	for (FileReference *p = first; p; p = p->next)
+		files.push_back(p);
+	
+	std::vector<size_t> order(files.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), SampleOrder(keys));
+	
+	/* Relink each run of equal keys, and note where it starts */
+	std::vector<size_t> starts;
+	for (size_t i = 0, j; i < order.size(); i = j)
+	{
+		for (j = i + 1; j < order.size() && keys[order[j]] == keys[order[i]]; ++j)
+			files[order[j - 1]]->next = files[order[j]];
+		files[order[j - 1]]->next = NULL;
+		
+		if (j - i == 1)
+		{
+			Stats::Count(STAT_PREFILTERED);
+			index.Release(files[order[i]]);
+		}
+		else
+			starts.push_back(order[i]);
+	}
+	
+	std::sort(starts.begin(), starts.end());
+	for (std::vector<size_t>::iterator it = starts.begin(); it != starts.end(); ++it)
+		out.push_back(std::make_pair(filesize, files[*it]));
+}
+
+void FastDup::Prefilter(SizeGroupList &groups)
+{
+	for (int pass = 0; pass < PASS_COUNT; ++pass)
+	{
+		PrefilterState state;
+		state.dup = this;
+		state.groups = &groups;
+		state.pass = (PrefilterPass)pass;
+		state.keys.resize(groups.size());
+		
+		unsigned depth = this->AssignLanes(groups, state.queue);
+		RunLanes(state.queue, depth, PrefilterThread, &state);
+		
+		SizeGroupList split;
+		split.reserve(groups.size());
+		for (size_t gi = 0; gi < groups.size(); ++gi)
+		{
+			if (state.keys[gi].empty())
+				split.push_back(groups[gi]);
+			else
+				SplitGroup(Files, groups[gi].first, groups[gi].second, state.keys[gi], split);
+		}
+		groups.swap(split);
+	}
+}
@@ -0,0 +1,968 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "reader.h"
+#include "stats.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <algorithm>
+
+/* Descriptors left for everything other than comparison, when the budget
+ * is taken from the open file limit */
+#define FD_RESERVE 64
+/* Buffers at least this large are mapped, and backed by huge pages */
+#define HUGE_PAGE (2 * 1048576)
+
+int OpenForCompare(const char *path, IoPolicy policy)
+{
+#ifdef O_DIRECT
+	if (policy == IO_DIRECT)
+	{
+		/* Not every filesystem can read around the cache; files on those
+		 * are dropped from it after reading instead */
+		int fd = CountedOpen(path, O_RDONLY | O_DIRECT);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+	}
+#endif
+
+	int fd = CountedOpen(path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (fd >= 0 && policy != IO_CACHED)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return fd;
+}
+
+ssize_t ReadForCompare(int fd, char *buf, size_t len, off_t offset, IoPolicy policy)
+{
+	size_t got = 0;
+	while (got < len)
+	{
+		/* Direct reads cover whole blocks, and stop short at the end of the
+		 * file */
+		size_t want = (policy == IO_DIRECT) ? IoAlign(len - got) : len - got;
+		ssize_t r = CountedPread(fd, buf + got, want, offset + got);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+#ifdef O_DIRECT
+			/* Not aligned as the filesystem needs it to be; read the rest of
+			 * the file through the cache */
+			int fl;
+			if (errno == EINVAL && policy == IO_DIRECT && (fl = fcntl(fd, F_GETFL)) >= 0 && (fl & O_DIRECT)
+			    && fcntl(fd, F_SETFL, fl & ~O_DIRECT) == 0)
+				continue;
+#endif
+			return -1;
+		}
+		else if (!r)
+			break;
+		got += r;
+	}
+
+	/* A file that has grown can fill the rest of the last block */
+	if (got > len)
+		got = len;
+#ifdef POSIX_FADV_DONTNEED
+	if (got && policy != IO_CACHED)
+		posix_fadvise(fd, offset, got, POSIX_FADV_DONTNEED);
+#endif
+	return got;
+}
+
+void IoBuffer::Release()
+{
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+	data = NULL;
+	size = 0;
+	mapped = false;
+}
+
+void IoBuffer::Reserve(size_t n)
+{
+	if (n <= size)
+		return;
+	Release();
+
+	if (n >= HUGE_PAGE)
+	{
+		n = (n + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+		void *p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED)
+		{
+#ifdef MADV_HUGEPAGE
+			madvise(p, n, MADV_HUGEPAGE);
+#endif
+			data = (char*)p;
+			size = n;
+			mapped = true;
+			return;
+		}
+	}
+
+	n = IoAlign(n);
+	void *p;
+	if (posix_memalign(&p, IO_ALIGN, n) != 0)
+		throw std::bad_alloc();
+	data = (char*)p;
+	size = n;
+}
+
+FdCache::FdCache(FileReference **f, int fc, unsigned b, IoPolicy p)
+	: files(f), fds(fc, -1), budget(b ? b : 1), open(0), policy(p), pos(fc)
+{
+}
+
+FdCache::~FdCache()
+{
+	while (!used.empty())
+		Close(used.front());
+}
+
+int FdCache::Get(int i)
+{
+	if (fds[i] >= 0)
+	{
+		used.splice(used.end(), used, pos[i]);
+		return fds[i];
+	}
+
+	/* Files are read in the same order for every block, so the file used
+	 * last is the one needed again the latest */
+	if (open >= budget)
+		Close(used.back());
+
+	char path[PATH_MAX];
+	files[i]->Path(path, sizeof(path));
+
+	int fd;
+	while ((fd = OpenForCompare(path, policy)) < 0)
+	{
+		/* Other descriptors are in use elsewhere; make room if we can */
+		if ((errno != EMFILE && errno != ENFILE) || used.empty())
+			return -1;
+		Close(used.back());
+	}
+
+	fds[i] = fd;
+	pos[i] = used.insert(used.end(), i);
+	open++;
+	return fd;
+}
+
+void FdCache::Close(int i)
+{
+	if (fds[i] < 0)
+		return;
+
+#ifdef POSIX_FADV_DONTNEED
+	/* Readahead brings in more of the file than was read, which dropping
+	 * each block after reading it leaves behind */
+	if (policy != IO_CACHED)
+		posix_fadvise(fds[i], 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fds[i]);
+	fds[i] = -1;
+	used.erase(pos[i]);
+	open--;
+}
+
+BlockReader::BlockReader(FileReference **f, int fc, off_t fs, unsigned fdbudget, IoPolicy p)
+	: files(f), fcount(fc), filesize(fs), offset(0), data(fc, (const char*)NULL), dropped(fc, false), failed(fc, false),
+	  fds(f, fc, fdbudget, p), policy(p), buffered(0), holestart(fc, 0), holeend(fc, 0), skipped(0)
+{
+}
+
+BlockReader::~BlockReader()
+{
+	Stats::Buffer(-(long long)buffered);
+}
+
+void BlockReader::Resize(IoBuffer &buf, size_t size)
+{
+	size_t old = buf.Size();
+	buf.Reserve(size);
+	Stats::Buffer((long long)buf.Size() - (long long)old);
+	buffered += buf.Size() - old;
+}
+
+/* Sparse files, such as disk images, can be mostly holes, which read as
+ * zeroes without touching the disk but still cost a copy and a compare for
+ * every byte. Where all of the files have a hole, they can't differ, so the
+ * range is skipped. Holes are found lazily, so files that have none cost a
+ * single lseek() for the first of them. A hole in some files but not others
+ * proves nothing, as the data there may be zeroes as well, and is read. */
+off_t BlockReader::HoleEnd(off_t from)
+{
+#ifdef SEEK_HOLE
+	off_t end = filesize;
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (dropped[i])
+			continue;
+		if (from >= holeend[i])
+			FindHole(i, from);
+		if (dropped[i])
+			continue;
+		if (holestart[i] > from)
+			return from;
+		if (holeend[i] < end)
+			end = holeend[i];
+	}
+
+	/* Reads must stay aligned for O_DIRECT */
+	end &= ~(off_t)(IO_ALIGN - 1);
+	if (end > from)
+		return end;
+#endif
+	return from;
+}
+
+void BlockReader::Skip(off_t to)
+{
+	if (to <= offset)
+		return;
+
+	Stats::Count(STAT_HOLES);
+	Stats::Count(STAT_HOLE_BYTES, to - offset);
+	skipped += to - offset;
+	offset = to;
+}
+
+void BlockReader::FindHole(int i, off_t from)
+{
+#ifdef SEEK_HOLE
+	holestart[i] = holeend[i] = filesize;
+
+	int fd = OpenFile(i);
+	if (fd < 0)
+		return;
+
+	/* Filesystems that don't track holes report the end of the file */
+	off_t start = lseek(fd, from, SEEK_HOLE);
+	if (start < 0 || start >= filesize)
+		return;
+
+	/* No data after the hole means it runs to the end */
+	off_t end = lseek(fd, start, SEEK_DATA);
+	holestart[i] = start;
+	if (end >= 0 && end < filesize)
+		holeend[i] = end;
+#endif
+}
+
+int BlockReader::OpenFile(int i)
+{
+	int fd = fds.Get(i);
+	if (fd < 0)
+	{
+		char path[PATH_MAX];
+		fprintf(stderr, "Unable to open file '%s': %s\n", files[i]->Path(path, sizeof(path)), strerror(errno));
+		Fail(i);
+	}
+	return fd;
+}
+
+size_t BlockReader::IoSize()
+{
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (dropped[i])
+			continue;
+		
+		struct stat st;
+		int fd = OpenFile(i);
+		if (fd >= 0 && fstat(fd, &st) == 0)
+			return st.st_blksize;
+	}
+	return 0;
+}
+
+void BlockReader::ReadError(int i, int error)
+{
+	fprintf(stderr, "%d: Read error: %s\n", i, strerror(error));
+	// Note: if handled in any other way, cleanup
+	exit(EXIT_FAILURE);
+}
+
+void BlockReader::Fail(int i)
+{
+	Drop(i);
+	failed[i] = true;
+}
+
+size_t BlockReader::BlockLength(off_t at, size_t len) const
+{
+	if (at >= filesize)
+		return 0;
+	else if ((off_t)len > filesize - at)
+		return filesize - at;
+	return len;
+}
+
+unsigned BlockReader::FdBudget(const DupOptions &opt, unsigned threads)
+{
+	unsigned long limit = opt.fdlimit;
+	if (!limit)
+	{
+		struct rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+			limit = 1024;
+		else
+			limit = rl.rlim_cur;
+		limit = (limit > FD_RESERVE * 2) ? limit - FD_RESERVE : limit / 2;
+	}
+
+	if (!threads)
+		threads = opt.threads ? opt.threads : 1;
+	limit /= threads;
+	return (limit < 2) ? 2 : limit;
+}
+
+BlockReader *BlockReader::Create(const DupOptions &opt, unsigned threads, FileReference **files, int fcount,
+                                 off_t filesize)
+{
+	unsigned budget = FdBudget(opt, threads);
+
+#ifdef HAVE_IO_URING
+	if (opt.engine == ENGINE_URING && (unsigned)fcount <= budget)
+	{
+		IoRing *ring = UringBlockReader::ThreadRing();
+		if (ring)
+			return new UringBlockReader(ring, files, fcount, filesize, opt.iopolicy);
+	}
+#endif
+	/* Mapped pages can't be dropped from the cache while they are mapped,
+	 * so the cache is only kept out of it by reading */
+	if (opt.engine == ENGINE_MMAP && opt.iopolicy == IO_CACHED)
+		return new MmapBlockReader(files, fcount, filesize, budget);
+
+	return new ReadBlockReader(files, fcount, filesize, budget, opt.iopolicy, opt.physical);
+}
+
+/* Upper bounds on the length of each run, and on the memory used by the
+ * runs of all files */
+#define RUN_MAX (8 * 1048576)
+#define RUN_BUDGET (256 * 1048576)
+
+/* Runs are whole multiples of IO_ALIGN, so that every block after the first
+ * run still starts on a boundary that direct reads and the cache need */
+static size_t RunAlign(size_t len)
+{
+	len &= ~(size_t)(IO_ALIGN - 1);
+	return len ? len : IO_ALIGN;
+}
+
+ReadBlockReader::ReadBlockReader(FileReference **f, int fc, off_t fs, unsigned fdbudget, IoPolicy p, bool phys)
+	: BlockReader(f, fc, fs, fdbudget, p), bufsz(0), physical(phys), runoff(0), runlen(0), runfill(0), runmax(0)
+{
+	if (physical)
+	{
+		layouts.resize(fcount);
+		for (int i = 0; i < fcount; ++i)
+		{
+			int fd = OpenFile(i);
+			if (fd >= 0)
+				layouts[i].Load(fd, files[i]->ino);
+		}
+
+		runmax = RUN_BUDGET / fcount;
+		if (runmax > RUN_MAX)
+			runmax = RUN_MAX;
+		runmax = RunAlign(runmax);
+	}
+}
+
+ReadBlockReader::~ReadBlockReader()
+{
+}
+
+struct PhysicalOrder
+{
+	FileReference **files;
+	std::vector<PhysicalKey> &pos;
+
+	PhysicalOrder(FileReference **f, std::vector<PhysicalKey> &p) : files(f), pos(p) { }
+
+	bool operator()(int a, int b) const
+	{
+		if (files[a]->dev != files[b]->dev)
+			return files[a]->dev < files[b]->dev;
+		return pos[a] < pos[b];
+	}
+};
+
+/* Read the next run from every file, in the order they are laid out */
+void ReadBlockReader::Refill(size_t len)
+{
+	runoff = offset;
+	runlen = runlen ? runlen * 2 : len;
+	if (runlen > runmax)
+		runlen = runmax;
+	if (runlen < len)
+		runlen = len;
+	runlen = RunAlign(runlen);
+
+	runfill = BlockLength(offset, runlen);
+	if (!runfill)
+		return;
+
+	if (runfill > bufsz)
+	{
+		bufsz = IoAlign(runfill);
+		Resize(buf, bufsz * fcount);
+	}
+
+	std::vector<int> order;
+	std::vector<PhysicalKey> pos(fcount);
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (dropped[i])
+			continue;
+		order.push_back(i);
+		pos[i] = layouts[i].Physical(runoff);
+	}
+	std::sort(order.begin(), order.end(), PhysicalOrder(files, pos));
+
+	for (std::vector<int>::iterator it = order.begin(); it != order.end(); ++it)
+	{
+		int fd = OpenFile(*it);
+		if (fd < 0)
+			continue;
+
+		ssize_t got = ReadForCompare(fd, buf.Data() + bufsz * *it, runfill, runoff, policy);
+		if (got < 0)
+			ReadError(*it, errno);
+		else if ((size_t)got < runfill)
+			Fail(*it);
+	}
+}
+
+ssize_t ReadBlockReader::Next(size_t len)
+{
+	if (physical)
+	{
+		if (offset >= runoff + (off_t)runfill)
+		{
+			Skip(HoleEnd(offset));
+			Refill(len);
+		}
+
+		size_t rdbp = runoff + runfill - offset;
+		if (rdbp > len)
+			rdbp = len;
+		if (!rdbp)
+			return 0;
+
+		for (int i = 0; i < fcount; ++i)
+		{
+			if (!dropped[i])
+				data[i] = buf.Data() + bufsz * i + (offset - runoff);
+		}
+
+		offset += rdbp;
+		return rdbp;
+	}
+
+	if (len > bufsz)
+	{
+		bufsz = IoAlign(len);
+		Resize(buf, bufsz * fcount);
+	}
+
+	Skip(HoleEnd(offset));
+	size_t rdbp = BlockLength(offset, len);
+	if (!rdbp)
+		return 0;
+
+	for (int i = 0; i < fcount; i++)
+	{
+		if (dropped[i])
+			continue;
+
+		int fd = OpenFile(i);
+		if (fd < 0)
+			continue;
+
+		char *p = buf.Data() + bufsz * i;
+		ssize_t got = ReadForCompare(fd, p, rdbp, offset, policy);
+		if (got < 0)
+			ReadError(i, errno);
+		else if ((size_t)got < rdbp)
+		{
+			Fail(i);
+			continue;
+		}
+
+		data[i] = p;
+	}
+
+	offset += rdbp;
+	return rdbp;
+}
+
+void ReadBlockReader::Drop(int i)
+{
+	dropped[i] = true;
+	fds.Close(i);
+}
+
+/* The mmap reader currently in use by each thread, and where to jump to if
+ * a SIGBUS happens while it is touching pages in Next() */
+static __thread MmapBlockReader *busreader = NULL;
+static __thread sigjmp_buf *busjmp = NULL;
+static pthread_once_t busonce = PTHREAD_ONCE_INIT;
+
+static void BusHandler(int sig, siginfo_t *si, void *ctx)
+{
+	if (busjmp)
+		siglongjmp(*busjmp, 1);
+
+	/* Faulted while comparing; map zeroes over the missing page so that the
+	 * comparison can finish, and have it repeated with another reader */
+	if (busreader && busreader->Patch(si->si_addr))
+		return;
+
+	/* Not ours; let the default action happen when the access is retried */
+	signal(SIGBUS, SIG_DFL);
+}
+
+static void InstallBusHandler()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = BusHandler;
+	/* NODEFER, so that jumping out of the handler leaves SIGBUS unblocked
+	 * without having to save the signal mask on every sigsetjmp */
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+}
+
+MmapBlockReader::MmapBlockReader(FileReference **f, int fc, off_t fs, unsigned fdbudget)
+	: BlockReader(f, fc, fs, fdbudget, IO_CACHED), maps(fc, (char*)NULL), bufsz(0), maplen(fs), unreliable(false)
+{
+	pthread_once(&busonce, InstallBusHandler);
+	busreader = this;
+
+	for (int i = 0; i < fcount; ++i)
+	{
+		int fd = OpenFile(i);
+		if (fd < 0)
+			continue;
+
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size != filesize)
+		{
+			Fail(i);
+			continue;
+		}
+
+		void *p = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			continue;
+
+		madvise(p, maplen, MADV_SEQUENTIAL);
+		maps[i] = (char*)p;
+		fds.Close(i);
+	}
+}
+
+MmapBlockReader::~MmapBlockReader()
+{
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (!dropped[i])
+			Drop(i);
+	}
+	busreader = NULL;
+}
+
+/* Fault in every page of a block, catching SIGBUS if the file has been
+ * truncated underneath the mapping */
+bool MmapBlockReader::Touch(const char *p, size_t len)
+{
+	static const size_t pagesz = sysconf(_SC_PAGESIZE);
+	sigjmp_buf jmp;
+
+	if (sigsetjmp(jmp, 0))
+	{
+		busjmp = NULL;
+		return false;
+	}
+
+	busjmp = &jmp;
+	for (size_t i = 0; i < len; i += pagesz)
+		*(volatile const char*)(p + i);
+	*(volatile const char*)(p + len - 1);
+	busjmp = NULL;
+	return true;
+}
+
+ssize_t MmapBlockReader::Next(size_t len)
+{
+	Skip(HoleEnd(offset));
+	size_t rdbp = BlockLength(offset, len);
+	if (!rdbp)
+		return 0;
+
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (dropped[i])
+			continue;
+
+		if (maps[i])
+		{
+			if (!Touch(maps[i] + offset, rdbp))
+			{
+				Fail(i);
+				continue;
+			}
+			Stats::Count(STAT_READ_BYTES, rdbp);
+			data[i] = maps[i] + offset;
+			continue;
+		}
+
+		/* Could not be mapped; read it instead */
+		if (rdbp > bufsz)
+		{
+			bufsz = IoAlign(rdbp);
+			Resize(buf, bufsz * fcount);
+		}
+
+		int fd = OpenFile(i);
+		if (fd < 0)
+			continue;
+
+		char *p = buf.Data() + bufsz * i;
+		ssize_t got = ReadForCompare(fd, p, rdbp, offset, policy);
+		if (got < 0)
+			ReadError(i, errno);
+		else if ((size_t)got < rdbp)
+		{
+			Fail(i);
+			continue;
+		}
+		data[i] = p;
+	}
+
+	offset += rdbp;
+	return rdbp;
+}
+
+void MmapBlockReader::Drop(int i)
+{
+	dropped[i] = true;
+	if (maps[i])
+	{
+		munmap(maps[i], maplen);
+		maps[i] = NULL;
+	}
+	fds.Close(i);
+}
+
+bool MmapBlockReader::Patch(void *addr)
+{
+	static const size_t pagesz = sysconf(_SC_PAGESIZE);
+	char *a = (char*)addr;
+
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (!maps[i] || a < maps[i] || a >= maps[i] + maplen)
+			continue;
+
+		char *page = (char*)((unsigned long)a & ~(pagesz - 1));
+		if (mmap(page, pagesz, PROT_READ, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == MAP_FAILED)
+			return false;
+		unreliable = true;
+		return true;
+	}
+
+	return false;
+}
+
+#ifdef HAVE_IO_URING
+
+/* Completions of cancel requests are tagged, and otherwise ignored */
+#define CANCEL_TAG (1ULL << 63)
+
+static pthread_key_t ringkey;
+static pthread_once_t ringonce = PTHREAD_ONCE_INIT;
+static __thread bool ringfailed = false;
+
+static void DeleteRing(void *ring)
+{
+	delete static_cast<IoRing*>(ring);
+}
+
+static void CreateRingKey()
+{
+	pthread_key_create(&ringkey, DeleteRing);
+}
+
+IoRing *UringBlockReader::ThreadRing()
+{
+	pthread_once(&ringonce, CreateRingKey);
+
+	IoRing *ring = static_cast<IoRing*>(pthread_getspecific(ringkey));
+	if (!ring && !ringfailed)
+	{
+		try
+		{
+			ring = new IoRing(256);
+			pthread_setspecific(ringkey, ring);
+		}
+		catch (std::runtime_error &)
+		{
+			/* Fall back to read() for the rest of this thread */
+			ringfailed = true;
+		}
+	}
+
+	return ring;
+}
+
+UringBlockReader::UringBlockReader(IoRing *r, FileReference **f, int fc, off_t fs, IoPolicy p)
+	: BlockReader(f, fc, fs, fc, p), ring(r), cur(0), pendlen(0), pendstride(0), pendoff(0), submitted(false),
+	  result(fc, 0), inflight(fc, false), waiting(0)
+{
+}
+
+UringBlockReader::~UringBlockReader()
+{
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (!dropped[i])
+			Drop(i);
+	}
+
+	/* Buffers must not be released while the kernel may still write to them */
+	while (ring->Inflight())
+		Complete(true);
+}
+
+/* Queue a read of file i at pendoff into the pending buffer set, making room
+ * in the ring if necessary */
+void UringBlockReader::Prep(int i)
+{
+	int fd = OpenFile(i);
+	if (fd < 0)
+		return;
+
+	/* Direct reads must cover whole blocks, which the stride leaves room for */
+	char *p = buf[cur ^ 1].Data() + pendstride * i;
+	while (!ring->PrepRead(fd, p, (policy == IO_DIRECT) ? pendstride : pendlen, pendoff, i))
+	{
+		if (!ring->Submit(0))
+			ReadError(i, errno);
+		Complete(true);
+	}
+
+	Stats::Count(STAT_READS);
+	inflight[i] = true;
+	waiting++;
+}
+
+/* Start reading the block of up to len bytes at offset */
+void UringBlockReader::Submit(size_t len)
+{
+	/* The hole is only skipped once the block after it is returned, so that
+	 * Offset() and Skipped() still describe the block being compared */
+	pendoff = HoleEnd(offset);
+	pendlen = BlockLength(pendoff, len);
+	pendstride = IoAlign(pendlen);
+	submitted = true;
+
+	/* The rest of the files is holes */
+	if (!pendlen)
+		return;
+
+	/* A cancelled read of a dropped file may still be writing into this set
+	 * of buffers, until its completion arrives; nothing else is in flight
+	 * now, as every other read has been waited for */
+	while (ring->Inflight())
+		Complete(true);
+
+	Resize(buf[cur ^ 1], pendstride * fcount);
+
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (!dropped[i])
+			Prep(i);
+	}
+
+	if (!ring->Submit(0))
+		ReadError(0, errno);
+}
+
+/* Reap one completion */
+void UringBlockReader::Complete(bool wait)
+{
+	unsigned long long ud;
+	int res;
+	if (!ring->Reap(&ud, &res, wait))
+	{
+		if (wait)
+			ReadError(0, errno);
+		return;
+	}
+
+	if (ud & CANCEL_TAG)
+		return;
+
+	int i = (int)ud;
+	inflight[i] = false;
+	if (dropped[i])
+	{
+		/* The read was cancelled (or finished before it could be); the file
+		 * can be closed now that the kernel is done with it */
+		fds.Close(i);
+		return;
+	}
+
+	if (res > 0)
+		Stats::Count(STAT_READ_BYTES, res);
+	result[i] = res;
+	waiting--;
+}
+
+ssize_t UringBlockReader::Next(size_t len)
+{
+	if (!submitted)
+	{
+		if (offset >= filesize)
+			return 0;
+		Submit(len);
+	}
+
+	while (waiting)
+		Complete(true);
+	submitted = false;
+	Skip(pendoff);
+	if (!pendlen)
+		return 0;
+
+	char *pbuf = buf[cur ^ 1].Data();
+	for (int i = 0; i < fcount; ++i)
+	{
+		if (dropped[i])
+			continue;
+
+		/* A filesystem that can't read this directly is read through the
+		 * cache, below */
+		if (result[i] < 0 && !(result[i] == -EINVAL && policy == IO_DIRECT))
+			ReadError(i, -result[i]);
+
+		/* Short reads can happen; finish them synchronously */
+		size_t got = (result[i] > 0) ? result[i] : 0;
+		char *p = pbuf + pendstride * i;
+		if (got < pendlen)
+		{
+			ssize_t r = ReadForCompare(fds.Get(i), p + got, pendlen - got, pendoff + got, policy);
+			if (r < 0)
+				ReadError(i, errno);
+			got += r;
+		}
+#ifdef POSIX_FADV_DONTNEED
+		if (policy != IO_CACHED)
+			posix_fadvise(fds.Get(i), pendoff, pendlen, POSIX_FADV_DONTNEED);
+#endif
+
+		if (got < pendlen)
+		{
+			Fail(i);
+			continue;
+		}
+
+		data[i] = p;
+	}
+
+	/* The block read ahead has the length asked for last time; when more
+	 * is asked for now, as the block size grows, the rest of it is read
+	 * here, into the buffers of the block just compared */
+	size_t rdbp = pendlen;
+	size_t want = BlockLength(pendoff, len);
+	if (want > pendlen)
+	{
+		size_t stride = IoAlign(want);
+		Resize(buf[cur], stride * fcount);
+		for (int i = 0; i < fcount; ++i)
+		{
+			if (dropped[i])
+				continue;
+
+			char *p = buf[cur].Data() + stride * i;
+			memcpy(p, data[i], pendlen);
+			ssize_t r = ReadForCompare(fds.Get(i), p + pendlen, want - pendlen, pendoff + pendlen, policy);
+			if (r < 0)
+				ReadError(i, errno);
+#ifdef POSIX_FADV_DONTNEED
+			if (policy != IO_CACHED)
+				posix_fadvise(fds.Get(i), pendoff + pendlen, want - pendlen, POSIX_FADV_DONTNEED);
+#endif
+			if ((size_t)r < want - pendlen)
+			{
+				Fail(i);
+				continue;
+			}
+			data[i] = p;
+		}
+		rdbp = want;
+	}
+	else
+		cur ^= 1;
+	offset = pendoff + rdbp;
+
+	/* Start reading the next block while this one is compared */
+	if (offset < filesize)
+		Submit(len);
+
+	return rdbp;
+}
+
+void UringBlockReader::Drop(int i)
+{
+	dropped[i] = true;
+
+	if (inflight[i])
+	{
+		/* The file is closed once the read completes, which Submit() waits
+		 * for before the buffer is used again. If there's no room to cancel
+		 * it, it just completes normally. */
+		waiting--;
+		ring->PrepCancel(i, CANCEL_TAG | i);
+		ring->Submit(0);
+		return;
+	}
+
+	fds.Close(i);
+}
+
+#endif
@@ -21,42 +21,734 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <deque>
+#include "uring.h"
+#include "stats.h"
 
 #ifdef __APPLE__
 # define NO_FSTATAT
 # define NO_READLINKAT
 #endif
 
-static char errbuf[1024];
+#ifdef __linux__
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# define HAVE_GETDENTS64
+/* Not provided by older C libraries */
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
 /* Used for interactive display */
 double scanstart = 0, lasttime = 0;
 
-void FastDup::ScanDirectory(const char *basepath, int bplen, const char *name, ErrorCallback cberror)
+/* Directories are scanned as independent tasks. Each worker owns a deque of
+ * directories waiting to be scanned; subdirectories found by a worker are
+ * pushed onto the back of its own deque and popped from the back again,
+ * which keeps a single worker walking depth-first. Idle workers steal from
+ * the front of other deques, taking the shallowest (and usually largest)
+ * pending subtree. Each worker indexes its files into a private FileIndex,
+ * and these are merged once all workers have finished, so the index is
+ * never shared between threads.
+ *
+ * With opt.devdepth, each disk gets a lane of that many workers, which only
+ * steal from each other. A worker that opens a directory on a disk with a
+ * lane of its own hands it over to that lane, so every disk is kept busy
+ * with no more than its own share of requests at once.
+ */
+/* A directory waiting to be scanned */
+struct ScanTask
+{
+	DirReference *dir;
+	/* Filesystem of the tree it was found in, for opt.onefs */
+	dev_t dev;
+};
+
+/* A directory entry, and the metadata we need from it */
+struct ScanEntry
+{
+	/* Offset of the name in ScanWorker::names */
+	size_t name;
+	/* Type reported by the directory (DT_*), which may be DT_UNKNOWN */
+	unsigned char type;
+	/* errno from looking up the entry, or 0 */
+	int error;
+	mode_t mode;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	/* Modification and change times, in nanoseconds */
+	unsigned long long mtime, ctime;
+};
+
+struct FastDup::ScanState
+{
+	FastDup *dup;
+	ErrorCallback cberror;
+	std::vector<ScanWorker*> workers;
+	/* Number of lanes, and of workers in each; the workers of a lane are
+	 * together in workers */
+	unsigned lanes, depth;
+	/* Number of directories queued or being scanned; the scan is finished
+	 * when this reaches zero */
+	volatile long pending;
+	/* Number of workers waiting for work in idlecond */
+	volatile int idle;
+	pthread_mutex_t idlelock;
+	pthread_cond_t idlecond;
+	/* Serializes calls to cberror and interactive output */
+	pthread_mutex_t outlock;
+	
+	ScanState(FastDup *d, ErrorCallback cb)
+		: dup(d), cberror(cb), lanes(1), depth(1), pending(0), idle(0)
+	{
+		pthread_mutex_init(&idlelock, NULL);
+		pthread_cond_init(&idlecond, NULL);
+		pthread_mutex_init(&outlock, NULL);
+	}
+	
+	~ScanState()
+	{
+		pthread_mutex_destroy(&idlelock);
+		pthread_cond_destroy(&idlecond);
+		pthread_mutex_destroy(&outlock);
+	}
+	
+	void Error(const char *path, const char *error)
+	{
+		pthread_mutex_lock(&outlock);
+		cberror(path, error);
+		pthread_mutex_unlock(&outlock);
+	}
+	
+	unsigned long FileCount();
+	bool HasWork(unsigned lane);
+};
+
+struct FastDup::ScanWorker
+{
+	ScanState *state;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	std::deque<ScanTask> tasks;
+	unsigned lane;
+	
+	/* Private index of files found by this worker, merged into Files after
+	 * scanning */
+	FileIndex files;
+	volatile unsigned long FileCount;
+	off_t FileSizeTotal;
+	
+	/* Entries of the directory currently being scanned; reused for each
+	 * directory to avoid reallocating */
+	std::vector<ScanEntry> entries;
+	std::vector<char> names;
+#ifdef HAVE_GETDENTS64
+	/* Buffer for getdents64(); much larger than the one readdir() uses, so
+	 * that big directories are read with few syscalls */
+	std::vector<char> dentbuf;
+#endif
+	
+#ifdef HAVE_IO_URING
+	/* Ring used to request metadata for a whole directory at a time, or NULL
+	 * to use fstatat() */
+	IoRing *ring;
+	std::vector<struct statx> stx;
+#endif
+	
+	ScanWorker(ScanState *s, unsigned l)
+		: state(s), lane(l), FileCount(0), FileSizeTotal(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+#ifdef HAVE_IO_URING
+		ring = NULL;
+		if (s->dup->opt.uring)
+		{
+			try
+			{
+				ring = new IoRing(256);
+			}
+			catch (std::runtime_error &)
+			{
+				/* Not available on this kernel; use the fstatat() path */
+			}
+		}
+#endif
+	}
+	
+	~ScanWorker()
+	{
+		pthread_mutex_destroy(&lock);
+#ifdef HAVE_IO_URING
+		delete ring;
+#endif
+	}
+	
+	void AddEntry(const char *name, size_t len, unsigned char type);
+	void StatEntries(int dfd);
+#ifdef HAVE_IO_URING
+	bool StatEntriesUring(int dfd);
+#endif
+	
+	void Push(DirReference *dir, dev_t dev)
+	{
+		ScanTask task = { dir, dev };
+		__sync_fetch_and_add(&state->pending, 1);
+		
+		pthread_mutex_lock(&lock);
+		tasks.push_back(task);
+		pthread_mutex_unlock(&lock);
+		
+		__sync_synchronize();
+		if (state->idle)
+		{
+			/* With several lanes, the worker woken must be one of ours */
+			pthread_mutex_lock(&state->idlelock);
+			if (state->lanes > 1)
+				pthread_cond_broadcast(&state->idlecond);
+			else
+				pthread_cond_signal(&state->idlecond);
+			pthread_mutex_unlock(&state->idlelock);
+		}
+	}
+	
+	bool Pop(ScanTask *task)
+	{
+		bool re = false;
+		pthread_mutex_lock(&lock);
+		if (!tasks.empty())
+		{
+			*task = tasks.back();
+			tasks.pop_back();
+			re = true;
+		}
+		pthread_mutex_unlock(&lock);
+		return re;
+	}
+	
+	bool Steal(ScanTask *task)
+	{
+		bool re = false;
+		if (pthread_mutex_trylock(&lock) != 0)
+			return false;
+		if (!tasks.empty())
+		{
+			*task = tasks.front();
+			tasks.pop_front();
+			re = true;
+		}
+		pthread_mutex_unlock(&lock);
+		return re;
+	}
+	
+	void AddFile(DirReference *dir, const char *name, off_t size, dev_t dev, ino_t ino, unsigned long long mtime,
+	             unsigned long long ctime)
+	{
+		FileCount++;
+		FileSizeTotal += size;
+		files.Add(size, dir, name, dev, ino, mtime, ctime);
+	}
+};
+
+/* Queue a directory entry for processing. Most filesystems report the type
+ * of an entry in the directory itself, so anything that can't be a file or
+ * lead to one is dropped here, before we spend a syscall on it. */
+void FastDup::ScanWorker::AddEntry(const char *name, size_t len, unsigned char type)
 {
-	/* Used in FileReferences to save memory by only storing the path once */
-	DirReference *dirref = new DirReference(basepath, bplen, name);
-	int pathlen = strlen(dirref->path);
+	/* Eliminate . and .. */
+	if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+		return;
+	
+	switch (type)
+	{
+		case DT_FIFO:
+		case DT_SOCK:
+		case DT_CHR:
+		case DT_BLK:
+			return;
+	}
+	
+	ScanEntry e;
+	e.name = names.size();
+	e.type = type;
+	e.error = 0;
+	names.insert(names.end(), name, name + len + 1);
+	entries.push_back(e);
+}
+
+/* Look up metadata for every entry in entries. Only regular files (and
+ * entries of unknown type) need a stat for their size; directories and
+ * links are fully described by their type. */
+void FastDup::ScanWorker::StatEntries(int dfd)
+{
+	bool needstat = false;
+	for (std::vector<ScanEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
+	{
+		if (it->type == DT_DIR)
+			it->mode = S_IFDIR;
+		else if (it->type == DT_LNK)
+			it->mode = S_IFLNK;
+		else
+			needstat = true;
+	}
+	
+	if (!needstat)
+		return;
+	
+#ifdef HAVE_IO_URING
+	if (ring && StatEntriesUring(dfd))
+		return;
+#endif
+	
+	struct stat st;
+	for (std::vector<ScanEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
+	{
+		if (it->type == DT_DIR || it->type == DT_LNK)
+			continue;
+		
+		Stats::Count(STAT_STATS);
+		unsigned long long start = Stats::Start();
+#ifndef NO_FSTATAT
+		/* fstatat() avoids lookups and permissions checks, since we already have a dirfd */
+		int re = fstatat(dfd, &names[it->name], &st, AT_SYMLINK_NOFOLLOW);
+#else
+		int re = lstat(&names[it->name], &st);
+#endif
+		Stats::Finish(LAT_STAT, start);
+		if (re < 0)
+		{
+			it->error = errno;
+			continue;
+		}
+		
+		it->error = 0;
+		it->mode = st.st_mode;
+		it->size = st.st_size;
+		it->dev = st.st_dev;
+		it->ino = st.st_ino;
+		it->mtime = StatTime(st.st_mtim);
+		it->ctime = StatTime(st.st_ctim);
+	}
+}
+
+#ifdef HAVE_IO_URING
+/* Submit a statx request for each entry to the ring, as many at a time as
+ * it will hold, so the kernel can service a whole directory without a
+ * syscall round trip for each file. Only the fields we use are requested,
+ * which lets network filesystems skip fetching the rest. Returns false if
+ * the ring can't be used, in which case the ring is released and the caller
+ * should fall back to fstatat().
+ */
+bool FastDup::ScanWorker::StatEntriesUring(int dfd)
+{
+	unsigned mask = STATX_TYPE | STATX_SIZE | STATX_INO;
+	if (state->dup->opt.cachefile)
+		mask |= STATX_MTIME | STATX_CTIME;
+	
+	if (stx.size() < ring->Size())
+		stx.resize(ring->Size());
+	
+	for (size_t next = 0; next < entries.size();)
+	{
+		/* Entries in this batch, by index in stx */
+		size_t batch[ring->Size()];
+		unsigned count = 0;
+		
+		for (; next < entries.size() && count < ring->Size(); ++next)
+		{
+			ScanEntry &e = entries[next];
+			if (e.type == DT_DIR || e.type == DT_LNK)
+				continue;
+			
+			ring->PrepStatx(dfd, &names[e.name], AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, mask, &stx[count], count);
+			batch[count++] = next;
+		}
+		
+		if (!count)
+			break;
+		
+		/* Latency isn't recorded, as the requests of a batch overlap */
+		Stats::Count(STAT_STATS, count);
+		if (!ring->Submit(count))
+			goto failed;
+		
+		unsigned long long i;
+		int res;
+		while (ring->Reap(&i, &res, true))
+		{
+			ScanEntry &e = entries[batch[i]];
+			if (res < 0)
+			{
+				/* Kernels before 5.6 don't know IORING_OP_STATX */
+				if (res == -EINVAL)
+					goto failed;
+				e.error = -res;
+				continue;
+			}
+			
+			e.error = 0;
+			e.mode = stx[i].stx_mode;
+			e.size = stx[i].stx_size;
+			e.dev = makedev(stx[i].stx_dev_major, stx[i].stx_dev_minor);
+			e.ino = stx[i].stx_ino;
+			e.mtime = stx[i].stx_mtime.tv_sec * 1000000000ULL + stx[i].stx_mtime.tv_nsec;
+			e.ctime = stx[i].stx_ctime.tv_sec * 1000000000ULL + stx[i].stx_ctime.tv_nsec;
+		}
+	}
+	
+	return true;
+	
+ failed:
+	while (ring->Inflight())
+	{
+		unsigned long long i;
+		int res;
+		if (!ring->Reap(&i, &res, true))
+			break;
+	}
+	delete ring;
+	ring = NULL;
+	return false;
+}
+#endif
+
+/* True if path is within any of the trees we are scanning */
+bool FastDup::InScannedTree(const char *path)
+{
+	for (std::vector<std::string>::iterator it = DirList.begin(); it != DirList.end(); ++it)
+	{
+		if (strncmp(it->c_str(), path, ((*it)[it->length()-1] == '/') ? it->length()-1 : it->length()) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Check a file's size against the conditions of opt; empty files are never
+ * compared */
+bool FastDup::WantSize(off_t size) const
+{
+	if (!size)
+		return false;
+	if (opt.sz_eq && (size != opt.sz_eq))
+		return false;
+	else if (opt.sz_min && (size < opt.sz_min))
+		return false;
+	else if (opt.sz_max && (size > opt.sz_max))
+		return false;
+	return true;
+}
+
+/* Find what a symbolic link leads to, and stat it into st. We need to check
+ * if the link leads to a path under any tree we're scanning, to prevent
+ * false results (the same file/files would show twice) and link recursion.
+ * This gets complicated because links may be relative to the directory they
+ * are in - so, we have to get the link, make it absolute, and clean any
+ * special segments (.., etc) out for it to be safely compared to our paths.
+ *
+ * lbuf holds the lblen bytes of the link, and has room for PATH_MAX + 1;
+ * path is the directory it is in, pathlen bytes ending in '/'. Returns false
+ * if the link isn't followed; if that is because of an error, errbuf says
+ * why, and lbuf holds the path it concerns, otherwise errbuf is empty.
+ */
+bool FastDup::FollowLink(char *lbuf, int lblen, const char *path, size_t pathlen, struct stat &st, char *errbuf,
+                         size_t errlen)
+{
+	char clbuf[PATH_MAX + 1];
+	errbuf[0] = 0;
+	
+	if (lbuf[0] != '/')
+	{
+		// Relative path, prepend this directory
+		if (pathlen + lblen > PATH_MAX)
+		{
+			snprintf(errbuf, errlen, "Unable to resolve invalid link path");
+			return false;
+		}
+		memmove(lbuf + pathlen, lbuf, lblen + 1);
+		memcpy(lbuf, path, pathlen);
+	}
+	
+	if (!PathResolve(clbuf, PATH_MAX + 1, lbuf))
+	{
+		snprintf(errbuf, errlen, "Unable to resolve invalid link path");
+		return false;
+	}
+	
+	/* If the destination of this link is within a path we will scan, don't follow it
+	 * to avoid false positives. */
+	if (this->InScannedTree(clbuf))
+		return false;
+	
+	if (CountedStat(clbuf, &st, false) < 0)
+	{
+		snprintf(errbuf, errlen, "Unable to read file information for link destination: %s", strerror(errno));
+		strcpy(lbuf, clbuf);
+		return false;
+	}
+	
+	if (S_ISLNK(st.st_mode))
+	{
+		/* The destination is another link. Follow the whole chain at once, as
+		 * reprocessing would read this same link again, and check that the
+		 * final target is outside our paths as well. */
+		if (!realpath(clbuf, lbuf) || CountedStat(lbuf, &st) < 0)
+		{
+			snprintf(errbuf, errlen, "Unable to read file information for link destination: %s", strerror(errno));
+			strcpy(lbuf, clbuf);
+			return false;
+		}
+		
+		if (this->InScannedTree(lbuf))
+			return false;
+	}
+	
+	return true;
+}
+
+unsigned long FastDup::ScanState::FileCount()
+{
+	unsigned long re = 0;
+	for (std::vector<ScanWorker*>::iterator it = workers.begin(); it != workers.end(); ++it)
+		re += (*it)->FileCount;
+	return re;
+}
+
+bool FastDup::ScanState::HasWork(unsigned lane)
+{
+	for (std::vector<ScanWorker*>::iterator it = workers.begin(); it != workers.end(); ++it)
+	{
+		ScanWorker *w = *it;
+		if (w->lane != lane)
+			continue;
+		pthread_mutex_lock(&w->lock);
+		bool empty = w->tasks.empty();
+		pthread_mutex_unlock(&w->lock);
+		if (!empty)
+			return true;
+	}
+	return false;
+}
+
+void FastDup::ScanTrees(ErrorCallback cberror)
+{
+	ScanState state(this, cberror);
+	state.depth = opt.threads ? opt.threads : 1;
+	
+	/* Filesystem of each tree */
+	std::vector<dev_t> rootdevs;
+	for (std::vector<std::string>::iterator it = DirList.begin(); it != DirList.end(); ++it)
+	{
+		struct stat st;
+		rootdevs.push_back((CountedStat(it->c_str(), &st) == 0) ? st.st_dev : 0);
+	}
+	
+	if (opt.devdepth)
+	{
+		/* Give a lane to every disk with a tree on it, and to any that is
+		 * mounted within the trees */
+		state.depth = opt.devdepth;
+		for (std::vector<dev_t>::iterator it = rootdevs.begin(); it != rootdevs.end(); ++it)
+			Devices.Lane(*it);
+		
+		if (!opt.onefs)
+		{
+			std::vector<std::string> mounts;
+			MountPoints(mounts);
+			for (std::vector<std::string>::iterator it = mounts.begin(); it != mounts.end(); ++it)
+			{
+				struct stat st;
+				if (this->InScannedTree(it->c_str()) && CountedStat(it->c_str(), &st) == 0)
+					Devices.Lane(st.st_dev);
+			}
+		}
+		state.lanes = Devices.Count();
+	}
+	
+#ifdef NO_FSTATAT
+	/* Without fstatat we must fchdir into each directory, which can't be
+	 * shared between threads */
+	state.lanes = state.depth = 1;
+#endif
+	
+	unsigned threads = state.lanes * state.depth;
+	for (unsigned i = 0; i < threads; ++i)
+		state.workers.push_back(new ScanWorker(&state, i / state.depth));
+	
+	for (size_t i = 0; i < DirList.size(); ++i)
+	{
+		unsigned lane = (state.lanes > 1) ? Devices.Lane(rootdevs[i]) : 0;
+		state.workers[lane * state.depth]->Push(Files.AddDirectory(NULL, DirList[i].c_str()), rootdevs[i]);
+	}
+	
+	for (unsigned i = 1; i < threads; ++i)
+	{
+		if (pthread_create(&state.workers[i]->thread, NULL, ScanThread, state.workers[i]) != 0)
+			throw std::runtime_error("Unable to create scanning thread");
+	}
+	
+	this->ScanWorkerLoop(state.workers[0]);
+	
+	for (unsigned i = 1; i < threads; ++i)
+		pthread_join(state.workers[i]->thread, NULL);
+	
+	/* Merge the private indexes of each worker */
+	for (std::vector<ScanWorker*>::iterator wit = state.workers.begin(); wit != state.workers.end(); ++wit)
+	{
+		ScanWorker *w = *wit;
+		FileCount += w->FileCount;
+		FileSizeTotal += w->FileSizeTotal;
+		Files.Merge(w->files);
+		delete w;
+	}
+}
+
+void *FastDup::ScanThread(void *arg)
+{
+	ScanWorker *w = static_cast<ScanWorker*>(arg);
+	w->state->dup->ScanWorkerLoop(w);
+	return NULL;
+}
+
+void FastDup::ScanWorkerLoop(ScanWorker *w)
+{
+	ScanState *state = w->state;
+	
+	for (;;)
+	{
+		ScanTask task;
+		bool found = w->Pop(&task);
+		
+		for (size_t i = 0; !found && i < state->workers.size(); ++i)
+		{
+			if (state->workers[i] != w && state->workers[i]->lane == w->lane)
+				found = state->workers[i]->Steal(&task);
+		}
+		
+		if (found)
+		{
+			this->ScanDirectory(w, task);
+			if (__sync_sub_and_fetch(&state->pending, 1) == 0)
+			{
+				pthread_mutex_lock(&state->idlelock);
+				pthread_cond_broadcast(&state->idlecond);
+				pthread_mutex_unlock(&state->idlelock);
+			}
+			continue;
+		}
+		
+		/* Nothing to steal; wait until more directories are queued, or
+		 * every queued directory has been scanned */
+		pthread_mutex_lock(&state->idlelock);
+		state->idle++;
+		__sync_synchronize();
+		while (state->pending && !state->HasWork(w->lane))
+			pthread_cond_wait(&state->idlecond, &state->idlelock);
+		state->idle--;
+		bool done = !state->pending;
+		pthread_mutex_unlock(&state->idlelock);
+		
+		if (done)
+			break;
+	}
+}
+
+void FastDup::ScanDirectory(ScanWorker *worker, const ScanTask &task)
+{
+	ScanState *state = worker->state;
+	DirReference *dirref = task.dir;
+	char errbuf[1024];
+	char path[PATH_MAX + 1];
+	int pathlen = dirref->Path(path, sizeof(path));
 	
 	if (Interactive)
 	{
 		double now = SSTime();
-		if (now - lasttime >= 0.1)
+		if (now - lasttime >= 0.1 && pthread_mutex_trylock(&state->outlock) == 0)
 		{
 			/* Restore saved position, then overwrite with the new information */
-			printf("\E[u%lu files in %.3f seconds", FileCount, now - scanstart);
+			printf("\E[u%lu files in %.3f seconds", state->FileCount(), now - scanstart);
 			fflush(stdout);
 			lasttime = now;
+			pthread_mutex_unlock(&state->outlock);
 		}
 	}
 
-	DIR *d = opendir(dirref->path);
+	/* Read the whole directory first, so that metadata for all of its
+	 * entries can be requested as one batch */
+	worker->entries.clear();
+	worker->names.clear();
+	
+	Stats::Count(STAT_DIRS);
+#ifdef HAVE_GETDENTS64
+	int dfd = CountedOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+	{
+		snprintf(errbuf, sizeof(errbuf), "Unable to open directory: %s", strerror(errno));
+		state->Error(path, errbuf);
+		return;
+	}
+	
+	if (!this->ScanHere(worker, task, dfd))
+	{
+		close(dfd);
+		return;
+	}
+	
+	std::vector<char> &dentbuf = worker->dentbuf;
+	if (dentbuf.empty())
+		dentbuf.resize(256 * 1024);
+	
+	for (;;)
+	{
+		long rdlen = syscall(SYS_getdents64, dfd, &dentbuf[0], dentbuf.size());
+		Stats::Count(STAT_DIR_READS);
+		if (rdlen < 0)
+		{
+			snprintf(errbuf, sizeof(errbuf), "Unable to read directory: %s", strerror(errno));
+			state->Error(path, errbuf);
+			break;
+		}
+		else if (!rdlen)
+			break;
+		
+		for (long bp = 0; bp < rdlen;)
+		{
+			struct linux_dirent64 *de = (struct linux_dirent64*)&dentbuf[bp];
+			worker->AddEntry(de->d_name, strlen(de->d_name), de->d_type);
+			bp += de->d_reclen;
+		}
+	}
+#else
+	unsigned long long openstart = Stats::Start();
+	DIR *d = opendir(path);
+	Stats::Finish(LAT_OPEN, openstart);
+	Stats::Count(STAT_OPENS);
 	if (!d)
 	{
 		snprintf(errbuf, sizeof(errbuf), "Unable to open directory: %s", strerror(errno));
-		cberror(dirref->path, errbuf);
-		delete dirref;
+		state->Error(path, errbuf);
 		return;
 	}
+	
+	struct dirent *de;
+	int dfd = dirfd(d);
+	
+	if (!this->ScanHere(worker, task, dfd))
+	{
+		closedir(d);
+		return;
+	}
+	
+	while ((de = readdir(d)) != NULL)
+		worker->AddEntry(de->d_name, strlen(de->d_name), de->d_type);
+#endif
 
 #ifdef NO_FSTATAT
 	/* Lack of fstatat() requires us to actually change the working
@@ -67,154 +759,128 @@ void FastDup::ScanDirectory(const char *basepath, int bplen, const char *name, E
 	 */
 	char returnpath[PATH_MAX + 1];
 	char *cwd = getcwd(returnpath, PATH_MAX);
-#endif
-
-	struct dirent *de;
-	struct stat st;
-	int dfd = dirfd(d);
-
-#ifdef NO_FSTATAT
+	
 	if (fchdir(dfd) < 0)
 	{
 		snprintf(errbuf, sizeof(errbuf), "Unable to fchdir: %s", strerror(errno));
-		cberror(PathMerge(dirref->path, de->d_name).c_str(), errbuf);
+		state->Error(path, errbuf);
+		closedir(d);
 		return;
 	}
 #endif
 
-	while ((de = readdir(d)) != NULL)
+	std::vector<ScanEntry> &entries = worker->entries;
+	std::vector<char> &names = worker->names;
+	
+	worker->StatEntries(dfd);
+	
+	for (std::vector<ScanEntry>::iterator eit = entries.begin(); eit != entries.end(); ++eit)
 	{
-		/* Eliminate . and .. */
-		if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
-			continue;
+		const char *name = &names[eit->name];
+		mode_t mode = eit->mode;
+		off_t size = eit->size;
+		dev_t dev = eit->dev;
+		ino_t ino = eit->ino;
+		unsigned long long mtime = eit->mtime, ctime = eit->ctime;
 		
-#ifndef NO_FSTATAT
-		/* fstatat() avoids lookups and permissions checks, since we already have a dirfd */
-		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
-#else
-		if (lstat(de->d_name, &st) < 0)
-#endif
+		if (eit->error)
 		{
-			snprintf(errbuf, sizeof(errbuf), "Unable to read file information: %s", strerror(errno));
-			cberror(PathMerge(dirref->path, de->d_name).c_str(), errbuf);
+			snprintf(errbuf, sizeof(errbuf), "Unable to read file information: %s", strerror(eit->error));
+			state->Error(PathMerge(path, name).c_str(), errbuf);
 			continue;
 		}
 		
+		/* Directories are checked once they are opened */
+		if (opt.onefs && !S_ISDIR(mode) && !S_ISLNK(mode) && dev != task.dev)
+			continue;
+		
  process_dir_item:
-		if (S_ISLNK(st.st_mode))
-		{
-			/* We need to check if this link leads to a path under any tree we're scanning,
-			 * to prevent false results (the same file/files would show twice) and link
-			 * recursion. This gets complicated because links may be relative to the 
-			 * directory they are in - so, we have to get the link, make it absolute, and 
-			 * clean any special segments (.., etc) out for it to be safely compared to
-			 * our paths.
-			 */
+		if (S_ISLNK(mode))
+		{
 			char lbuf[PATH_MAX + 1];
-			char clbuf[PATH_MAX + 1];
-
 #ifndef NO_READLINKAT
-			int lblen = readlinkat(dfd, de->d_name, lbuf, PATH_MAX);
+			int lblen = readlinkat(dfd, name, lbuf, PATH_MAX);
 #else
-			int lblen = readlink(de->d_name, lbuf, PATH_MAX);
+			int lblen = readlink(name, lbuf, PATH_MAX);
 #endif
 			if (lblen <= 0)
 			{
 				snprintf(errbuf, sizeof(errbuf), "Unable to read link information: %s", strerror(errno));
-				cberror(PathMerge(dirref->path, de->d_name).c_str(), errbuf);
+				state->Error(PathMerge(path, name).c_str(), errbuf);
 				continue;
 			}
 			lbuf[lblen] = 0;
 			
-			if (lbuf[0] != '/')
-			{
-				// Relative path, prepend this directory
-				memmove(lbuf + pathlen, lbuf, lblen + 1);
-				memcpy(lbuf, dirref->path, pathlen);
-				lblen += pathlen;
-			}
-			
-			if (!PathResolve(clbuf, PATH_MAX + 1, lbuf))
+			/* Link resolved; stat the destination and reprocess with that */
+			struct stat st;
+			if (!this->FollowLink(lbuf, lblen, path, pathlen, st, errbuf, sizeof(errbuf)))
 			{
-				snprintf(errbuf, sizeof(errbuf), "Unable to resolve invalid link path");
-				cberror(lbuf, errbuf);
+				if (errbuf[0])
+					state->Error(lbuf, errbuf);
 				continue;
 			}
 			
-			/* If the destination of this link is within a path we will scan, don't follow it
-			 * to avoid false positives. */
-			bool invalid = false;
-			for (std::vector<std::string>::iterator it = DirList.begin(); it != DirList.end(); ++it)
-			{
-				if (strncmp(it->c_str(), clbuf, ((*it)[it->length()-1] == '/') ? it->length()-1 : it->length()) == 0)
-				{
-					invalid = true;
-					break;
-				}
-			}
-			
-			if (invalid)
+			if (opt.onefs && st.st_dev != task.dev)
 				continue;
 			
-			/* Link resolved; stat the destination and reprocess with that */
-			if (lstat(clbuf, &st) < 0)
-			{
-				snprintf(errbuf, sizeof(errbuf), "Unable to read file information for link destination: %s", strerror(errno));
-				cberror(clbuf, errbuf);
-				continue;
-			}
-			
+			mode = st.st_mode;
+			size = st.st_size;
+			dev = st.st_dev;
+			ino = st.st_ino;
+			mtime = StatTime(st.st_mtim);
+			ctime = StatTime(st.st_ctim);
 			goto process_dir_item;
 		}
 		
-		if (S_ISREG(st.st_mode))
+		if (S_ISREG(mode))
 		{
-			if (!st.st_size)
-				continue;
-			
-			if (opt.sz_eq && (st.st_size != opt.sz_eq))
-				continue;
-			else if (opt.sz_min && (st.st_size < opt.sz_min))
-				continue;
-			else if (opt.sz_max && (st.st_size > opt.sz_max))
+			if (!this->WantSize(size))
 				continue;
 			
-			FileCount++;
-			FileSizeTotal += st.st_size;
-			
-			/* Create FileReference */
-			FileReference *ref = new FileReference(dirref, de->d_name);
-			
-			/* Add FileReference to our list; if a file with this size is known,
-			 * the reference is appended to the linked list. */
-			std::map<off_t,FileReference*>::iterator it = FileSzMap.find(st.st_size);
-			if (it == FileSzMap.end())
-			{
-				FileSzMap.insert(std::make_pair(st.st_size, ref));
-			}
-			else if (!it->second->next)
-			{
-				it->second->next = ref;
-				CandidateSetCount++;
-			}
-			else
-			{
-				FileReference *i = it->second;
-				while (i->next != NULL)
-					i = i->next;
-				i->next = ref;
-			}
+			worker->AddFile(dirref, name, size, dev, ino, mtime, ctime);
 		}
-		else if (S_ISDIR(st.st_mode))
+		else if (S_ISDIR(mode))
 		{
-			this->ScanDirectory(dirref->path, pathlen, de->d_name, cberror);
+			/* Directories are stored by name below their parent, so that the
+			 * path they share with their files is only stored once */
+			worker->Push(worker->files.AddDirectory(dirref, name), task.dev);
 		}
 	}
 	
+#ifdef HAVE_GETDENTS64
+	close(dfd);
+#else
 	closedir(d);
-	if (!dirref->RefCount())
-		delete dirref;
+#endif
 #ifdef NO_FSTATAT
 	chdir(cwd);
 #endif
 }
+
+/* Check that a directory just opened as dfd should be scanned, and by this
+ * worker. Directories on another filesystem are skipped with opt.onefs, and
+ * those on a disk with a lane of its own are passed to that lane. */
+bool FastDup::ScanHere(ScanWorker *worker, const ScanTask &task, int dfd)
+{
+	ScanState *state = worker->state;
+	if (!opt.onefs && state->lanes <= 1)
+		return true;
+	
+	struct stat st;
+	if (fstat(dfd, &st) < 0)
+		return true;
+	
+	if (opt.onefs && st.st_dev != task.dev)
+		return false;
+	
+	if (state->lanes > 1)
+	{
+		unsigned lane = Devices.Lane(st.st_dev);
+		if (lane != worker->lane && lane < state->lanes)
+		{
+			state->workers[lane * state->depth]->Push(task.dir, task.dev);
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,264 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* Latencies of 2^STAT_BUCKETS nanoseconds (about a minute) or more all go
+ * in the last bucket */
+#define STAT_BUCKETS 36
+
+bool Stats::enabled = false;
+
+static const char *PhaseNames[PHASE_COUNT] = { "scan", "prefilter", "compare" };
+static const char *CounterNames[STAT_COUNT] =
+{
+	"directories", "directory_reads", "stats", "opens", "reads", "read_bytes", "block_compares", "compare_bytes",
+	"hash_sorted_blocks", "hardlinks_skipped", "prefilter_splits", "cache_splits", "early_omits", "omitted_bytes",
+	"holes_skipped", "hole_bytes"
+};
+static const char *LatencyNames[LAT_COUNT] = { "stat", "open", "read" };
+
+struct StatHistogram
+{
+	unsigned long long count, total, max;
+	unsigned long long buckets[STAT_BUCKETS];
+};
+
+struct StatBlock
+{
+	unsigned long long count[PHASE_COUNT][STAT_COUNT];
+	StatHistogram latency[PHASE_COUNT][LAT_COUNT];
+};
+
+static volatile StatPhase phase = PHASE_SCAN;
+/* Time each phase started, and the time spent in each */
+static unsigned long long phasestart = 0;
+static double phasetime[PHASE_COUNT];
+
+/* Counts of threads that have exited */
+static StatBlock total;
+static pthread_mutex_t totallock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t blockkey;
+static pthread_once_t blockonce = PTHREAD_ONCE_INIT;
+static __thread StatBlock *local = NULL;
+/* Counts of the main thread, which is still running when they are written */
+static StatBlock *mainblock = NULL;
+
+static volatile long long buffered = 0, bufpeak = 0;
+
+static void AddBlock(StatBlock &to, const StatBlock &from)
+{
+	for (int ph = 0; ph < PHASE_COUNT; ++ph)
+	{
+		for (int c = 0; c < STAT_COUNT; ++c)
+			to.count[ph][c] += from.count[ph][c];
+		
+		for (int l = 0; l < LAT_COUNT; ++l)
+		{
+			StatHistogram &th = to.latency[ph][l];
+			const StatHistogram &fh = from.latency[ph][l];
+			th.count += fh.count;
+			th.total += fh.total;
+			if (fh.max > th.max)
+				th.max = fh.max;
+			for (int i = 0; i < STAT_BUCKETS; ++i)
+				th.buckets[i] += fh.buckets[i];
+		}
+	}
+}
+
+static void MergeBlock(void *p)
+{
+	StatBlock *b = static_cast<StatBlock*>(p);
+	pthread_mutex_lock(&totallock);
+	AddBlock(total, *b);
+	pthread_mutex_unlock(&totallock);
+	delete b;
+}
+
+static void CreateBlockKey()
+{
+	pthread_key_create(&blockkey, MergeBlock);
+}
+
+static StatBlock *Local()
+{
+	if (!local)
+	{
+		pthread_once(&blockonce, CreateBlockKey);
+		local = new StatBlock();
+		pthread_setspecific(blockkey, local);
+	}
+	return local;
+}
+
+unsigned long long Stats::Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void Stats::Add(StatCounter c, unsigned long long n)
+{
+	Local()->count[phase][c] += n;
+}
+
+void Stats::Record(StatLatency l, unsigned long long start)
+{
+	unsigned long long ns = Now() - start;
+	StatHistogram &h = Local()->latency[phase][l];
+	h.count++;
+	h.total += ns;
+	if (ns > h.max)
+		h.max = ns;
+	
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	h.buckets[(bucket < STAT_BUCKETS) ? bucket : STAT_BUCKETS - 1]++;
+}
+
+void Stats::Phase(StatPhase p)
+{
+	if (!enabled)
+		return;
+	
+	/* Phases are only started by the main thread */
+	mainblock = Local();
+	unsigned long long now = Now();
+	if (phasestart)
+		phasetime[phase] += (now - phasestart) / 1e9;
+	phasestart = now;
+	phase = p;
+}
+
+void Stats::Buffer(long long delta)
+{
+	if (!enabled)
+		return;
+	
+	long long now = __sync_add_and_fetch(&buffered, delta);
+	for (long long peak = bufpeak; now > peak; peak = bufpeak)
+	{
+		if (__sync_bool_compare_and_swap(&bufpeak, peak, now))
+			break;
+	}
+}
+
+static void WriteHistogram(FILE *f, const StatHistogram &h)
+{
+	fprintf(f, "{\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"buckets\": [", h.count, h.total, h.max);
+	bool first = true;
+	for (int i = 0; i < STAT_BUCKETS; ++i)
+	{
+		if (!h.buckets[i])
+			continue;
+		/* Each bucket counts latencies below the next power of two */
+		fprintf(f, "%s{\"lt_ns\": %llu, \"count\": %llu}", first ? "" : ", ", 2ULL << i, h.buckets[i]);
+		first = false;
+	}
+	fprintf(f, "]}");
+}
+
+bool Stats::Write(const char *path, const FastDup &dup, double seconds)
+{
+	Stats::Phase(phase);
+	
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return false;
+	
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		memset(&ru, 0, sizeof(ru));
+	
+	StatBlock sum;
+	pthread_mutex_lock(&totallock);
+	sum = total;
+	pthread_mutex_unlock(&totallock);
+	if (mainblock)
+		AddBlock(sum, *mainblock);
+	
+	fprintf(f, "{\n");
+	fprintf(f, "  \"version\": \"%s\",\n", FASTDUP_VERSION);
+	fprintf(f, "  \"seconds\": %.6f,\n", seconds);
+	fprintf(f, "  \"files\": %lu,\n", dup.FileCount);
+	fprintf(f, "  \"file_bytes\": %llu,\n", (unsigned long long)dup.FileSizeTotal);
+	fprintf(f, "  \"candidate_sets\": %lu,\n", dup.CandidateSetCount);
+	fprintf(f, "  \"duplicate_sets\": %lu,\n", dup.DupeSetCount);
+	fprintf(f, "  \"duplicate_files\": %lu,\n", dup.DupeFileCount);
+	fprintf(f, "  \"linked_sets\": %lu,\n", dup.LinkSetCount);
+	fprintf(f, "  \"linked_files\": %lu,\n", dup.LinkFileCount);
+	fprintf(f, "  \"peak_buffer_bytes\": %lld,\n", (long long)bufpeak);
+	fprintf(f, "  \"max_rss_kb\": %ld,\n", ru.ru_maxrss);
+	fprintf(f, "  \"phases\": {\n");
+	for (int ph = 0; ph < PHASE_COUNT; ++ph)
+	{
+		fprintf(f, "    \"%s\": {\n", PhaseNames[ph]);
+		fprintf(f, "      \"seconds\": %.6f,\n", phasetime[ph]);
+		for (int c = 0; c < STAT_COUNT; ++c)
+			fprintf(f, "      \"%s\": %llu,\n", CounterNames[c], sum.count[ph][c]);
+		fprintf(f, "      \"latency\": {\n");
+		for (int l = 0; l < LAT_COUNT; ++l)
+		{
+			fprintf(f, "        \"%s\": ", LatencyNames[l]);
+			WriteHistogram(f, sum.latency[ph][l]);
+			fprintf(f, "%s\n", (l + 1 < LAT_COUNT) ? "," : "");
+		}
+		fprintf(f, "      }\n");
+		fprintf(f, "    }%s\n", (ph + 1 < PHASE_COUNT) ? "," : "");
+	}
+	fprintf(f, "  }\n");
+	fprintf(f, "}\n");
+	
+	bool ok = !ferror(f);
+	return (fclose(f) == 0) && ok;
+}
+
+int CountedOpen(const char *path, int flags)
+{
+	unsigned long long start = Stats::Start();
+	int fd = open(path, flags);
+	Stats::Finish(LAT_OPEN, start);
+	Stats::Count(STAT_OPENS);
+	return fd;
+}
+
+int CountedStat(const char *path, struct stat *st, bool follow)
+{
+	unsigned long long start = Stats::Start();
+	int re = follow ? stat(path, st) : lstat(path, st);
+	Stats::Finish(LAT_STAT, start);
+	Stats::Count(STAT_STATS);
+	return re;
+}
+
+ssize_t CountedPread(int fd, void *buf, size_t len, off_t offset)
+{
+	unsigned long long start = Stats::Start();
+	ssize_t r = pread(fd, buf, len, offset);
+	Stats::Finish(LAT_READ, start);
+	Stats::Count(STAT_READS);
+	if (r > 0)
+		Stats::Count(STAT_READ_BYTES, r);
+	return r;
+}
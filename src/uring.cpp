@@ -0,0 +1,212 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+IoRing::IoRing(unsigned n)
+	: fd(-1), entries(0), sqmap(MAP_FAILED), cqmap(MAP_FAILED), sqes((struct io_uring_sqe*)MAP_FAILED),
+	  sqlocal(0), inflight(0)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	fd = syscall(__NR_io_uring_setup, n, &p);
+	if (fd < 0)
+		throw std::runtime_error(std::string("io_uring setup failed: ") + strerror(errno));
+
+	entries = p.sq_entries;
+	sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqmapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Newer kernels map both rings with a single mmap */
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (cqmapsz > sqmapsz)
+			sqmapsz = cqmapsz;
+		cqmapsz = sqmapsz;
+	}
+
+	sqmap = mmap(NULL, sqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sqmap == MAP_FAILED)
+	{
+		this->~IoRing();
+		throw std::runtime_error("io_uring ring mapping failed");
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cqmap = sqmap;
+	else
+	{
+		cqmap = mmap(NULL, cqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqmap == MAP_FAILED)
+		{
+			this->~IoRing();
+			throw std::runtime_error("io_uring ring mapping failed");
+		}
+	}
+
+	sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		this->~IoRing();
+		throw std::runtime_error("io_uring ring mapping failed");
+	}
+
+	char *sq = (char*)sqmap, *cq = (char*)cqmap;
+	sqhead = (unsigned*)(sq + p.sq_off.head);
+	sqtail = (unsigned*)(sq + p.sq_off.tail);
+	sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+	sqarray = (unsigned*)(sq + p.sq_off.array);
+	cqhead = (unsigned*)(cq + p.cq_off.head);
+	cqtail = (unsigned*)(cq + p.cq_off.tail);
+	cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	sqlocal = *sqtail;
+}
+
+IoRing::~IoRing()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, entries * sizeof(struct io_uring_sqe));
+	if (cqmap != MAP_FAILED && cqmap != sqmap)
+		munmap(cqmap, cqmapsz);
+	if (sqmap != MAP_FAILED)
+		munmap(sqmap, sqmapsz);
+	if (fd >= 0)
+		close(fd);
+	sqes = (struct io_uring_sqe*)MAP_FAILED;
+	cqmap = sqmap = MAP_FAILED;
+	fd = -1;
+}
+
+struct io_uring_sqe *IoRing::GetSqe()
+{
+	unsigned head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+	/* The completion queue is twice the size of the submission queue; don't
+	 * allow more than that in flight, or completions could be dropped. */
+	if (sqlocal - head >= entries || inflight >= entries * 2)
+		return NULL;
+
+	unsigned idx = sqlocal & *sqmask;
+	struct io_uring_sqe *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqarray[idx] = idx;
+	sqlocal++;
+	inflight++;
+	return sqe;
+}
+
+bool IoRing::PrepStatx(int dfd, const char *path, int flags, unsigned mask, struct statx *buf, unsigned long long data)
+{
+	struct io_uring_sqe *sqe = GetSqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dfd;
+	sqe->addr = (unsigned long)path;
+	sqe->len = mask;
+	sqe->off = (unsigned long)buf;
+	sqe->statx_flags = flags;
+	sqe->user_data = data;
+	return true;
+}
+
+bool IoRing::PrepRead(int rfd, void *buf, unsigned len, off_t offset, unsigned long long data)
+{
+	struct io_uring_sqe *sqe = GetSqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = rfd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = data;
+	return true;
+}
+
+bool IoRing::PrepCancel(unsigned long long target, unsigned long long data)
+{
+	struct io_uring_sqe *sqe = GetSqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+	return true;
+}
+
+bool IoRing::Submit(unsigned wait)
+{
+	unsigned tail = *sqtail;
+	__atomic_store_n(sqtail, sqlocal, __ATOMIC_RELEASE);
+
+	unsigned submit = sqlocal - tail;
+	if (wait > inflight)
+		wait = inflight;
+
+	while (submit || wait)
+	{
+		int re = syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (re < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		/* Waiting is satisfied by a single successful call */
+		submit -= ((unsigned)re < submit) ? re : submit;
+		wait = 0;
+	}
+
+	return true;
+}
+
+bool IoRing::Reap(unsigned long long *data, int *result, bool wait)
+{
+	for (;;)
+	{
+		unsigned head = *cqhead;
+		if (head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &cqes[head & *cqmask];
+			*data = cqe->user_data;
+			*result = cqe->res;
+			__atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+			inflight--;
+			return true;
+		}
+
+		if (!wait || !inflight || !Submit(1))
+			return false;
+	}
+}
+
+#endif
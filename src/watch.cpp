@@ -0,0 +1,706 @@
+/* FastDup (http://dev.dereferenced.net/fastdup/)
+ * Copyright 2013 - Robin Burchell <robin+git@viroteck.net>
+ * Copyright 2008 - John Brooks <special@dereferenced.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * A copy of the GNU General Public License is available in the
+ * LICENSE file distributed with this program.
+ */
+
+#include "main.h"
+#include "watch.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <set>
+#include <algorithm>
+
+#ifdef __linux__
+# include <poll.h>
+# include <sys/inotify.h>
+# include <sys/fanotify.h>
+# include <sys/statfs.h>
+#endif
+
+/* Changes are handled in batches, once nothing has changed for this long
+ * (in ms), so that a file being written is compared once it is complete,
+ * rather than at every write */
+#define WATCH_QUIET 1000
+/* Longest a batch is put off while things keep changing, in seconds */
+#define WATCH_MAX_DELAY 10
+
+#define INOTIFY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY \
+                        | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define FANOTIFY_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_MODIFY \
+                         | FAN_ONDIR)
+
+static std::string JoinPath(const std::string &dir, const char *name)
+{
+	if (!dir.empty() && dir[dir.size() - 1] == '/')
+		return dir + name;
+	return dir + "/" + name;
+}
+
+ChangeWatcher::ChangeWatcher()
+	: fd(-1), fanotify(false), overflow(false)
+{
+}
+
+ChangeWatcher::~ChangeWatcher()
+{
+	for (size_t i = 0; i < mounts.size(); ++i)
+		close(mounts[i].second);
+	if (fd >= 0)
+		close(fd);
+}
+
+#ifdef __linux__
+
+bool ChangeWatcher::StartFanotify(const std::vector<std::string> &trees)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	
+	for (std::vector<std::string>::const_iterator it = trees.begin(); it != trees.end(); ++it)
+	{
+		const char *tree = it->c_str();
+		struct statfs sfs;
+		if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS, AT_FDCWD, tree) < 0
+		    || statfs(tree, &sfs) < 0)
+			goto failed;
+		
+		int mfd = open(tree, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (mfd < 0)
+			goto failed;
+		mounts.push_back(std::make_pair(std::make_pair(sfs.f_fsid.__val[0], sfs.f_fsid.__val[1]), mfd));
+		
+		/* Events name directories by handle, and opening those needs
+		 * CAP_DAC_READ_SEARCH; make sure that works before relying on it */
+		struct
+		{
+			struct file_handle fh;
+			unsigned char data[MAX_HANDLE_SZ];
+		} h;
+		int mountid;
+		h.fh.handle_bytes = MAX_HANDLE_SZ;
+		if (name_to_handle_at(AT_FDCWD, tree, &h.fh, &mountid, 0) < 0)
+			goto failed;
+		int dfd = open_by_handle_at(mfd, &h.fh, O_PATH);
+		if (dfd < 0)
+			goto failed;
+		close(dfd);
+	}
+	
+	fanotify = true;
+	return true;
+	
+ failed:
+	for (size_t i = 0; i < mounts.size(); ++i)
+		close(mounts[i].second);
+	mounts.clear();
+	close(fd);
+	fd = -1;
+#else
+	(void)trees;
+#endif
+	return false;
+}
+
+bool ChangeWatcher::Start(const std::vector<std::string> &trees)
+{
+	if (this->StartFanotify(trees))
+		return true;
+	
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return fd >= 0;
+}
+
+bool ChangeWatcher::AddDirectory(const char *path, bool follow)
+{
+	if (fanotify)
+		return true;
+	
+	int wd = inotify_add_watch(fd, path, follow ? (INOTIFY_EVENTS & ~IN_DONT_FOLLOW) : INOTIFY_EVENTS);
+	if (wd < 0)
+		return false;
+	dirs[wd] = path;
+	return true;
+}
+
+void ChangeWatcher::ReadFanotify(const char *buf, ssize_t len, std::vector<std::string> &paths)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	const struct fanotify_event_metadata *m = (const struct fanotify_event_metadata*)buf;
+	for (; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len))
+	{
+		if (m->fd >= 0)
+			close(m->fd);
+		if (m->mask & FAN_Q_OVERFLOW)
+		{
+			overflow = true;
+			continue;
+		}
+		
+		const char *info = (const char*)m + m->metadata_len, *end = (const char*)m + m->event_len;
+		while (info + sizeof(struct fanotify_event_info_fid) <= end)
+		{
+			const struct fanotify_event_info_fid *fid = (const struct fanotify_event_info_fid*)info;
+			if (!fid->hdr.len)
+				break;
+			info += fid->hdr.len;
+			if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+				continue;
+			
+			int mfd = -1;
+			for (size_t i = 0; i < mounts.size(); ++i)
+			{
+				if (mounts[i].first.first == fid->fsid.val[0] && mounts[i].first.second == fid->fsid.val[1])
+					mfd = mounts[i].second;
+			}
+			if (mfd < 0)
+				continue;
+			
+			/* A directory that has since been deleted can't be opened; its
+			 * deletion is reported in its parent as well */
+			struct file_handle *fh = (struct file_handle*)fid->handle;
+			const char *name = (const char*)fh->f_handle + fh->handle_bytes;
+			int dfd = open_by_handle_at(mfd, fh, O_PATH);
+			if (dfd < 0)
+				continue;
+			
+			char link[32], dir[PATH_MAX];
+			snprintf(link, sizeof(link), "/proc/self/fd/%d", dfd);
+			ssize_t dlen = readlink(link, dir, sizeof(dir) - 1);
+			close(dfd);
+			if (dlen <= 0)
+				continue;
+			dir[dlen] = 0;
+			
+			if (!strcmp(name, "."))
+				paths.push_back(dir);
+			else
+				paths.push_back(JoinPath(dir, name));
+		}
+	}
+#else
+	(void)buf;
+	(void)len;
+	(void)paths;
+#endif
+}
+
+void ChangeWatcher::ReadInotify(const char *buf, ssize_t len, std::vector<std::string> &paths)
+{
+	for (const char *p = buf; p < buf + len;)
+	{
+		const struct inotify_event *ev = (const struct inotify_event*)p;
+		p += sizeof(struct inotify_event) + ev->len;
+		
+		if (ev->mask & IN_Q_OVERFLOW)
+		{
+			overflow = true;
+			continue;
+		}
+		
+		std::map<int, std::string>::iterator it = dirs.find(ev->wd);
+		if (it == dirs.end())
+			continue;
+		if (ev->mask & IN_IGNORED)
+		{
+			dirs.erase(it);
+			continue;
+		}
+		if (ev->len)
+			paths.push_back(JoinPath(it->second, ev->name));
+	}
+}
+
+bool ChangeWatcher::Read(std::vector<std::string> &paths, int timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	int r = poll(&pfd, 1, timeout);
+	if (r <= 0)
+		return r == 0 || errno == EINTR;
+	
+	/* Aligned for the event structures read into it */
+	static __thread long long buf[8192];
+	for (;;)
+	{
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN;
+		}
+		if (!len)
+			return true;
+		
+		if (fanotify)
+			this->ReadFanotify((const char*)buf, len, paths);
+		else
+			this->ReadInotify((const char*)buf, len, paths);
+	}
+}
+
+#else
+
+bool ChangeWatcher::Start(const std::vector<std::string> &)
+{
+	errno = ENOSYS;
+	return false;
+}
+
+bool ChangeWatcher::AddDirectory(const char *, bool)
+{
+	errno = ENOSYS;
+	return false;
+}
+
+bool ChangeWatcher::Read(std::vector<std::string> &, int)
+{
+	errno = ENOSYS;
+	return false;
+}
+
+#endif
+
+bool ChangeWatcher::Overflowed()
+{
+	bool re = overflow;
+	overflow = false;
+	return re;
+}
+
+/* State of a Watch(). Every file found is indexed by path, so that changes
+ * to a path can be applied to the size index; the sizes of groups that
+ * change are compared again once the changes settle. To report only what
+ * is new, the sets found in each group are kept as well.
+ */
+struct FastDup::WatchState
+{
+	FastDup *dup;
+	ErrorCallback errcb;
+	DupeSetCallback dupecb, linkcb;
+	ChangeWatcher watcher;
+	
+	std::map<std::string, std::pair<off_t, FileReference*> > files;
+	/* Lists of files of each size */
+	SizeRefMap groups;
+	/* Directories and names of files added since the scan, with the number
+	 * of those files using each. They're shared by every file added at the
+	 * same path, rather than piling up as the same files change over and
+	 * over, and freed along with the last file using them. */
+	std::map<std::string, std::pair<DirReference*, unsigned> > dirs;
+	std::map<std::string, unsigned> names;
+	/* Filesystem of each tree, for opt.onefs */
+	std::vector<dev_t> rootdevs;
+	/* Sizes of the groups that changed since they were last compared */
+	std::set<off_t> touched;
+	/* Sets last found in each group, by size, as lists of paths */
+	std::map<off_t, std::set<std::string> > reported;
+	
+	/* Groups being compared, their results, and the index of the next one
+	 * to be compared */
+	SizeGroupList jobs;
+	std::vector<DupeSetList> results;
+	volatile size_t next;
+	
+	WatchState(FastDup *d, ErrorCallback ecb, DupeSetCallback dcb, DupeSetCallback lcb)
+		: dup(d), errcb(ecb), dupecb(dcb), linkcb(lcb), next(0)
+	{
+	}
+	
+	~WatchState()
+	{
+		this->ClearNames();
+	}
+	
+	/* Drop a use of the directory and name of the file at path, if they are
+	 * those of a file added since the scan */
+	void Unref(const std::string &path, FileReference *ref)
+	{
+		size_t slash = path.rfind('/');
+		std::map<std::string, std::pair<DirReference*, unsigned> >::iterator dit
+			= dirs.find(path.substr(0, slash ? slash : 1));
+		if (dit == dirs.end() || dit->second.first != ref->dir)
+			return;
+		if (!--dit->second.second)
+		{
+			delete dit->second.first;
+			dirs.erase(dit);
+		}
+		
+		std::map<std::string, unsigned>::iterator nit = names.find(path.substr(slash + 1));
+		if (nit != names.end() && !--nit->second)
+			names.erase(nit);
+	}
+	
+	/* Free every directory and name, once no file uses them */
+	void ClearNames()
+	{
+		for (std::map<std::string, std::pair<DirReference*, unsigned> >::iterator it = dirs.begin(); it != dirs.end(); ++it)
+			delete it->second.first;
+		dirs.clear();
+		names.clear();
+	}
+};
+
+/* Take over the files of a scan, and index them by path */
+void FastDup::WatchIndex(WatchState *state)
+{
+	for (SizeGroupList::iterator it = CompareGroups.begin(); it != CompareGroups.end(); ++it)
+	{
+		char path[PATH_MAX];
+		for (FileReference *p = it->second; p; p = p->next)
+			state->files[p->Path(path, sizeof(path))] = std::make_pair(it->first, p);
+		state->groups[it->first] = it->second;
+		state->touched.insert(it->first);
+	}
+	CompareGroups.clear();
+}
+
+/* Forget a file that is no longer at its path, or every file below a
+ * directory that is gone */
+void FastDup::WatchRemove(WatchState *state, const std::string &path)
+{
+	std::map<std::string, std::pair<off_t, FileReference*> >::iterator it = state->files.find(path), end;
+	if (it != state->files.end())
+		end = it, ++end;
+	else
+	{
+		std::string prefix = JoinPath(path, "");
+		it = end = state->files.lower_bound(prefix);
+		while (end != state->files.end() && !end->first.compare(0, prefix.size(), prefix))
+			++end;
+	}
+	
+	while (it != end)
+	{
+		off_t size = it->second.first;
+		FileReference *ref = it->second.second;
+		
+		SizeRefMap::iterator group = state->groups.find(size);
+		FileReference **pp = &group->second;
+		while (*pp != ref)
+			pp = &(*pp)->next;
+		*pp = ref->next;
+		if (!group->second)
+			state->groups.erase(group);
+		
+		state->touched.insert(size);
+		FileCount--;
+		FileSizeTotal -= size;
+		state->Unref(it->first, ref);
+		Files.Release(ref);
+		state->files.erase(it++);
+	}
+}
+
+void FastDup::WatchAdd(WatchState *state, const std::string &path, const struct stat &st)
+{
+	off_t size = st.st_size;
+	if (!this->WantSize(size))
+		return;
+	
+	/* Directories are named by their whole path, which the map holds */
+	size_t slash = path.rfind('/');
+	std::pair<DirReference*, unsigned> unused((DirReference*)NULL, 0);
+	std::map<std::string, std::pair<DirReference*, unsigned> >::iterator dir
+		= state->dirs.insert(std::make_pair(path.substr(0, slash ? slash : 1), unused)).first;
+	if (!dir->second.first)
+		dir->second.first = new DirReference(NULL, dir->first.c_str());
+	dir->second.second++;
+	std::map<std::string, unsigned>::iterator name = state->names.insert(std::make_pair(path.substr(slash + 1), 0u)).first;
+	name->second++;
+	
+	FileReference *ref = Files.Alloc(dir->second.first, name->first.c_str(), st.st_dev, st.st_ino, StatTime(st.st_mtim),
+	                                 StatTime(st.st_ctim));
+	
+	FileReference *&head = state->groups[size];
+	ref->next = head;
+	head = ref;
+	
+	state->files[path] = std::make_pair(size, ref);
+	state->touched.insert(size);
+	FileCount++;
+	FileSizeTotal += size;
+}
+
+/* Follow the symbolic link at path as the scanner does, and stat what it
+ * leads to into st. Returns false if it isn't followed, after reporting why
+ * if that is an error and report is true. */
+bool FastDup::WatchLink(WatchState *state, const std::string &path, struct stat &st, bool report)
+{
+	char lbuf[PATH_MAX + 1], errbuf[512];
+	ssize_t lblen = readlink(path.c_str(), lbuf, PATH_MAX);
+	if (lblen <= 0)
+	{
+		snprintf(errbuf, sizeof(errbuf), "Unable to read link information: %s", strerror(errno));
+		if (report)
+			state->errcb(path.c_str(), errbuf);
+		return false;
+	}
+	lbuf[lblen] = 0;
+	
+	std::string dir = path.substr(0, path.rfind('/') + 1);
+	if (this->FollowLink(lbuf, lblen, dir.c_str(), dir.size(), st, errbuf, sizeof(errbuf)))
+		return true;
+	if (errbuf[0] && report)
+		state->errcb(lbuf, errbuf);
+	return false;
+}
+
+/* Index the file at path, or watch the directory, with the same conditions
+ * as the scanner finding it in the tree on rootdev */
+void FastDup::WatchEntry(WatchState *state, const std::string &path, bool addfiles, dev_t rootdev)
+{
+	struct stat st;
+	if (lstat(path.c_str(), &st) < 0)
+		return;
+	
+	bool link = S_ISLNK(st.st_mode);
+	if (link && !this->WatchLink(state, path, st, addfiles))
+		return;
+	if (opt.onefs && st.st_dev != rootdev)
+		return;
+	
+	if (S_ISDIR(st.st_mode))
+		this->WatchTree(state, path, addfiles, rootdev, link);
+	else if (S_ISREG(st.st_mode) && addfiles)
+		this->WatchAdd(state, path, st);
+}
+
+/* Watch a directory and those below it, and index the files in them if
+ * addfiles is true. path is followed if it is a symbolic link and follow is
+ * true. fanotify reports changes below a linked directory by the path they
+ * really have, outside the trees, so those are only seen with inotify. */
+void FastDup::WatchTree(WatchState *state, const std::string &path, bool addfiles, dev_t rootdev, bool follow)
+{
+	if (!state->watcher.AddDirectory(path.c_str(), follow))
+	{
+		char errbuf[512];
+		snprintf(errbuf, sizeof(errbuf), "Unable to watch directory: %s", strerror(errno));
+		state->errcb(path.c_str(), errbuf);
+	}
+	
+	DIR *d = opendir(path.c_str());
+	if (!d)
+		return;
+	
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL)
+	{
+		if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+			continue;
+		
+		std::string sub = JoinPath(path, de->d_name);
+		if (de->d_type == DT_DIR && !opt.onefs)
+		{
+			this->WatchTree(state, sub, addfiles, rootdev, false);
+			continue;
+		}
+		if (!addfiles && de->d_type == DT_REG)
+			continue;
+		
+		this->WatchEntry(state, sub, addfiles, rootdev);
+	}
+	
+	closedir(d);
+}
+
+/* Bring the index up to date with whatever is at path now */
+void FastDup::WatchPath(WatchState *state, const std::string &path)
+{
+	bool inside = false;
+	dev_t rootdev = 0;
+	for (size_t i = 0; i < DirList.size(); ++i)
+	{
+		const std::string &tree = DirList[i];
+		if (!path.compare(0, tree.size(), tree) && (path.size() == tree.size() || path[tree.size()] == '/'))
+		{
+			inside = true;
+			rootdev = state->rootdevs[i];
+		}
+	}
+	if (!inside)
+		return;
+	
+	this->WatchRemove(state, path);
+	this->WatchEntry(state, path, true, rootdev);
+}
+
+void *FastDup::WatchThread(void *arg)
+{
+	WatchState *state = static_cast<WatchState*>(arg);
+	FastDup *dup = state->dup;
+	
+	for (;;)
+	{
+		size_t gi = __sync_fetch_and_add(&state->next, 1);
+		if (gi >= state->jobs.size())
+			break;
+		dup->Compare(state->jobs[gi].second, state->jobs[gi].first, state->results[gi]);
+	}
+	
+	return NULL;
+}
+
+/* Compare the groups that changed, and report the sets that weren't
+ * already reported the last time those groups were compared */
+void FastDup::WatchCompare(WatchState *state)
+{
+	state->jobs.clear();
+	for (std::set<off_t>::iterator it = state->touched.begin(); it != state->touched.end(); ++it)
+	{
+		SizeRefMap::iterator group = state->groups.find(*it);
+		if (group != state->groups.end() && group->second->next)
+			state->jobs.push_back(*group);
+		else
+			state->reported.erase(*it);
+	}
+	state->touched.clear();
+	
+	state->results.assign(state->jobs.size(), DupeSetList());
+	state->next = 0;
+	
+	unsigned threads = opt.threads;
+	if (threads > state->jobs.size())
+		threads = state->jobs.size();
+	
+	std::vector<pthread_t> pool(threads);
+	for (unsigned i = 1; i < threads; ++i)
+	{
+		if (pthread_create(&pool[i], NULL, WatchThread, state) != 0)
+			throw std::runtime_error("Unable to create comparison thread");
+	}
+	
+	WatchThread(state);
+	
+	for (unsigned i = 1; i < threads; ++i)
+		pthread_join(pool[i], NULL);
+	
+	for (size_t gi = 0; gi < state->jobs.size(); ++gi)
+	{
+		off_t size = state->jobs[gi].first;
+		std::set<std::string> &before = state->reported[size];
+		std::set<std::string> now;
+		DupeSetList fresh;
+		
+		for (DupeSetList::iterator it = state->results[gi].begin(); it != state->results[gi].end(); ++it)
+		{
+			std::vector<std::string> paths;
+			char path[PATH_MAX];
+			for (std::vector<FileReference*>::iterator fit = it->files.begin(); fit != it->files.end(); ++fit)
+				paths.push_back((*fit)->Path(path, sizeof(path)));
+			std::sort(paths.begin(), paths.end());
+			
+			std::string key = it->linked ? "L" : "D";
+			for (std::vector<std::string>::iterator pit = paths.begin(); pit != paths.end(); ++pit)
+				key += "\n" + *pit;
+			
+			if (!before.count(key))
+				fresh.push_back(*it);
+			now.insert(key);
+		}
+		
+		this->ReportSets(fresh, size, state->dupecb, state->linkcb);
+		if (now.empty())
+			state->reported.erase(size);
+		else
+			before.swap(now);
+	}
+	
+	state->jobs.clear();
+	state->results.clear();
+}
+
+bool FastDup::Watch(ErrorCallback errcb, DupeSetCallback dupecb, DupeSetCallback linkcb)
+{
+	WatchState state(this, errcb, dupecb, linkcb);
+	
+	/* Start watching before scanning, so that nothing that changes during the
+	 * scan is missed */
+	if (!state.watcher.Start(DirList))
+		return false;
+	for (std::vector<std::string>::iterator it = DirList.begin(); it != DirList.end(); ++it)
+	{
+		struct stat st;
+		state.rootdevs.push_back((stat(it->c_str(), &st) == 0) ? st.st_dev : 0);
+	}
+	if (state.watcher.NeedsDirectories())
+	{
+		for (size_t i = 0; i < DirList.size(); ++i)
+			this->WatchTree(&state, DirList[i], false, state.rootdevs[i], true);
+	}
+	
+	this->DoScanning(errcb);
+	this->WatchIndex(&state);
+	this->WatchCompare(&state);
+	
+	fprintf(Messages, "Watching %lu file%s for changes (%s)...\n\n", FileCount, (FileCount != 1) ? "s" : "",
+	        state.watcher.Method());
+	fflush(Messages);
+	
+	for (;;)
+	{
+		std::vector<std::string> paths;
+		if (!state.watcher.Read(paths, -1))
+			return false;
+		
+		/* Let the changes settle before looking at them */
+		double start = SSTime();
+		for (;;)
+		{
+			size_t count = paths.size();
+			if (!state.watcher.Read(paths, WATCH_QUIET))
+				return false;
+			if (paths.size() == count || SSTime() - start > WATCH_MAX_DELAY)
+				break;
+		}
+		
+		if (state.watcher.Overflowed())
+		{
+			/* Changes were lost, so start again from a full scan */
+			for (SizeRefMap::iterator it = state.groups.begin(); it != state.groups.end(); ++it)
+				CompareGroups.push_back(*it);
+			state.groups.clear();
+			state.files.clear();
+			this->Cleanup();
+			state.ClearNames();
+			if (state.watcher.NeedsDirectories())
+			{
+				for (size_t i = 0; i < DirList.size(); ++i)
+					this->WatchTree(&state, DirList[i], false, state.rootdevs[i], true);
+			}
+			this->DoScanning(errcb);
+			this->WatchIndex(&state);
+		}
+		else
+		{
+			std::sort(paths.begin(), paths.end());
+			paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+			for (std::vector<std::string>::iterator it = paths.begin(); it != paths.end(); ++it)
+				this->WatchPath(&state, *it);
+		}
+		
+		this->WatchCompare(&state);
+		fflush(stdout);
+	}
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for the comparison cache: hashes cached while comparing
+# files in one group must match those of the same files compared in a group
+# of another size, or the cache splits identical files apart. With -P, the
+# length of each read depends on the size of the group.
+#
+# Usage: cache-groups.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/a" "$DIR/b"
+head -c 3000000 /dev/urandom > "$DIR/file" || exit 1
+i=0
+while [ $i -lt 300 ]; do
+	cp "$DIR/file" "$DIR/a/$i"
+	[ $i -lt 40 ] && cp "$DIR/file" "$DIR/b/$i"
+	i=$((i + 1))
+done
+rm "$DIR/file"
+# Files changed just before a run are not cached
+sleep 3
+
+# Each set is headed by its number of files
+sets()
+{
+	"$FASTDUP" -b "$@" | grep -c '^[0-9]* files ('
+}
+
+status=0
+for opts in "-P" "" "-e mmap" "-e uring"; do
+	"$FASTDUP" -b $opts -C "$DIR/cache" "$@" "$DIR/a" > /dev/null &&
+	"$FASTDUP" -b $opts -C "$DIR/cache" "$@" "$DIR/b" > /dev/null || exit 1
+	expect=$(sets $opts "$@" "$DIR/a" "$DIR/b")
+	got=$(sets $opts -C "$DIR/cache" "$@" "$DIR/a" "$DIR/b")
+	if [ "$expect" != 1 ] || [ "$got" != "$expect" ]; then
+		echo "FAIL cache-groups ($opts): $got sets with the cache, $expect without"
+		status=1
+	else
+		echo "PASS cache-groups ($opts)"
+	fi
+	rm -f "$DIR/cache"
+done
+exit $status
@@ -0,0 +1,48 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for -D: the sets found by having the filesystem compare
+# and share duplicates must be the same as those found by reading them. On
+# a filesystem that can't share data, this tests that -D falls back to
+# reading the files; on one that can (btrfs, XFS), that files differing in a
+# partial block at the end are told apart.
+#
+# Usage: dedupe.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Sizes that end in a partial block; in each group, two pairs of duplicates,
+# one pair differing in its last byte, and files of their own
+mkdir "$DIR/files"
+F="$DIR/files"
+for size in 20000001 300007; do
+	head -c $size /dev/urandom > "$F/$size-a1" || exit 1
+	cp "$F/$size-a1" "$F/$size-a2"
+	cp "$F/$size-a1" "$F/$size-b1"
+	printf 'x' | dd of="$F/$size-b1" bs=1 seek=$((size - 1)) conv=notrunc 2>/dev/null
+	cp "$F/$size-b1" "$F/$size-b2"
+	cp "$F/$size-a1" "$F/$size-c"
+	printf 'y' | dd of="$F/$size-c" bs=1 seek=$((size / 2)) conv=notrunc 2>/dev/null
+done
+
+# The paths of each set, one set per line
+sets()
+{
+	"$FASTDUP" -b "$@" | awk '/^[0-9]* files \(/ { if (s) print s; s = "" } /^\t/ { s = s " " $1 } END { if (s) print s }' | sort
+}
+
+status=0
+expect=$(sets "$@" "$F")
+for opts in "-D" "-D -j 2"; do
+	got=$(sets $opts "$@" "$F")
+	if [ "$(echo "$expect" | wc -l)" != 4 ] || [ "$got" != "$expect" ]; then
+		echo "FAIL dedupe ($opts): sets differ from those found by reading the files"
+		status=1
+	else
+		echo "PASS dedupe ($opts)"
+	fi
+done
+exit $status
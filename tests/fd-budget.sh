@@ -0,0 +1,48 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for the descriptor budget: a group with more files than -F
+# allows open at once is read by opening some of them again for each block,
+# and must still be split into the same sets as with every file open.
+#
+# Usage: fd-budget.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Two sets that differ near the end, and files of their own that differ
+# from both in the middle, so that files are dropped while others go on
+mkdir "$DIR/files"
+head -c 4000000 /dev/urandom > "$DIR/file" || exit 1
+i=0
+while [ $i -lt 40 ]; do
+	cp "$DIR/file" "$DIR/files/$i"
+	if [ $((i % 4)) = 1 ]; then
+		printf 'x' | dd of="$DIR/files/$i" bs=1 seek=3999000 conv=notrunc 2>/dev/null
+	elif [ $((i % 8)) = 2 ]; then
+		printf "$i" | dd of="$DIR/files/$i" bs=1 seek=2000000 conv=notrunc 2>/dev/null
+	fi
+	i=$((i + 1))
+done
+rm "$DIR/file"
+
+# The paths of each set, one set per line
+sets()
+{
+	"$FASTDUP" -b "$@" | awk '/^[0-9]* files \(/ { if (s) print s; s = "" } /^\t/ { s = s " " $1 } END { if (s) print s }' | sort
+}
+
+status=0
+for opts in "" "-e mmap" "-e uring" "-P"; do
+	expect=$(sets $opts "$@" "$DIR/files")
+	got=$(sets $opts -F 3 "$@" "$DIR/files")
+	if [ "$(echo "$expect" | wc -l)" != 2 ] || [ "$got" != "$expect" ]; then
+		echo "FAIL fd-budget ($opts): sets with -F 3 differ from those with every file open"
+		status=1
+	else
+		echo "PASS fd-budget ($opts)"
+	fi
+done
+exit $status
@@ -0,0 +1,46 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for hardlinks: paths that are links to one file are listed
+# as a set of their own, "already linked", and only one of them is compared
+# with other files, so that each copy is counted as a duplicate once.
+#
+# Usage: hardlinks.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Three links to a file with one copy, and two links to a file with none
+mkdir "$DIR/files"
+head -c 100000 /dev/urandom > "$DIR/files/a1" || exit 1
+ln "$DIR/files/a1" "$DIR/files/a2" && ln "$DIR/files/a1" "$DIR/files/a3" || exit 1
+cp "$DIR/files/a1" "$DIR/files/copy"
+head -c 100000 /dev/urandom > "$DIR/files/b1"
+ln "$DIR/files/b1" "$DIR/files/b2" || exit 1
+
+status=0
+check()
+{
+	if [ "$2" != "$3" ]; then
+		echo "FAIL hardlinks ($opts): $1 is '$2', not '$3'"
+		ok=0
+	fi
+}
+
+for opts in "" "-e mmap" "-H 2"; do
+	out=$("$FASTDUP" -b $opts "$@" "$DIR/files" 2>&1)
+	ok=1
+	check "linked sets" "$(echo "$out" | grep -c '^[0-9]* files (.*already linked)')" 2
+	check "sets" "$(echo "$out" | grep -c '^[0-9]* files (')" 3
+	check "links to a1" "$(echo "$out" | grep -A3 '^3 files (.*already linked)' | grep -c "$DIR/files/a")" 3
+	check "summary" "$(echo "$out" | grep '^Found .* duplicate')" "Found 1 duplicate of 1 file (97.66 KB wasted)"
+	check "link summary" "$(echo "$out" | grep '^Found .* hardlink')" "Found 3 hardlinks to 2 files (already linked)"
+	if [ $ok = 1 ]; then
+		echo "PASS hardlinks ($opts)"
+	else
+		status=1
+	fi
+done
+exit $status
@@ -0,0 +1,47 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for -H: sets compared by hashing whole files, with and
+# without -V, must be the same as those found by comparing blocks. Files
+# that differ only in their last byte, or only in the middle, must not be
+# reported together.
+#
+# Usage: hash-mode.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/files"
+head -c 1000000 /dev/urandom > "$DIR/file" || exit 1
+i=0
+while [ $i -lt 12 ]; do
+	cp "$DIR/file" "$DIR/files/$i"
+	if [ $((i % 3)) = 1 ]; then
+		printf 'x' | dd of="$DIR/files/$i" bs=1 seek=999999 conv=notrunc 2>/dev/null
+	elif [ $i = 5 ]; then
+		printf 'x' | dd of="$DIR/files/$i" bs=1 seek=500000 conv=notrunc 2>/dev/null
+	fi
+	i=$((i + 1))
+done
+rm "$DIR/file"
+
+# The paths of each set, one set per line
+sets()
+{
+	"$FASTDUP" -b "$@" | awk '/^[0-9]* files \(/ { if (s) print s; s = "" } /^\t/ { s = s " " $1 } END { if (s) print s }' | sort
+}
+
+status=0
+expect=$(sets "$@" "$DIR/files")
+for opts in "-H 2" "-H 2 -V" "-H 2 -P"; do
+	got=$(sets $opts "$@" "$DIR/files")
+	if [ "$(echo "$expect" | wc -l)" != 2 ] || [ "$got" != "$expect" ]; then
+		echo "FAIL hash-mode ($opts): sets differ from those found by comparing blocks"
+		status=1
+	else
+		echo "PASS hash-mode ($opts)"
+	fi
+done
+exit $status
@@ -0,0 +1,52 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for skipping holes: sparse files whose holes line up are
+# not read there, but data between and after the holes still is, so files
+# that only differ there are told apart. Every engine must find the same
+# sets, and skip the holes.
+#
+# Usage: holes.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Files of 65MB with data at the start, in the middle and near the end, and
+# holes between and after; one differs in the middle, one near the end, and
+# one has data where the others have a hole
+mkdir "$DIR/files"
+F="$DIR/files"
+head -c 65536 /dev/urandom > "$DIR/data" || exit 1
+for name in a b c mid end filled; do
+	truncate -s 65M "$F/$name" || exit 1
+	for at in 0 512 1023; do
+		dd if="$DIR/data" of="$F/$name" bs=64k seek=$at conv=notrunc 2>/dev/null
+	done
+done
+printf 'x' | dd of="$F/mid" bs=1 seek=33554500 conv=notrunc 2>/dev/null
+printf 'x' | dd of="$F/end" bs=1 seek=67108000 conv=notrunc 2>/dev/null
+dd if=/dev/zero of="$F/filled" bs=64k seek=100 count=16 conv=notrunc 2>/dev/null
+
+if [ "$(du -k "$F/a" | cut -f1)" -ge 65536 ]; then
+	echo "SKIP holes: $DIR does not keep sparse files"
+	exit 0
+fi
+
+status=0
+for opts in "" "-e mmap" "-e uring" "-P" "-O direct"; do
+	out=$("$FASTDUP" -b $opts --stats="$DIR/stats" "$@" "$F" 2>&1)
+	set=$(printf '%s\n' "$out" | grep -A4 '^[0-9]* files (' | grep "$F" | sed "s|.*$F/||" | sort | tr '\n' ' ')
+	skipped=$(tr ',' '\n' < "$DIR/stats" | sed -n 's/.*"hole_bytes": *//p' | awk '{ s += $1 } END { print s + 0 }')
+	if [ "$set" != "a b c filled " ]; then
+		echo "FAIL holes ($opts): found '$set', not 'a b c filled '"
+		status=1
+	elif [ "$skipped" -lt 1000000 ]; then
+		echo "FAIL holes ($opts): only $skipped bytes of holes skipped"
+		status=1
+	else
+		echo "PASS holes ($opts)"
+	fi
+done
+exit $status
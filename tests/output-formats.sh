@@ -0,0 +1,64 @@
+#!/bin/sh
+# FastDup (http://dev.dereferenced.net/fastdup/)
+#
+# Regression test for --json and -0. Paths in JSON must be escaped: quotes
+# and backslashes, control characters as \u00XX, and bytes that aren't
+# valid UTF-8 as lone surrogates \udcXX, while valid UTF-8 is kept as it
+# is. -0 must write paths as they are, end each set with an extra NUL, and
+# leave out sets that are already linked.
+#
+# Usage: output-formats.sh path/to/fastdup [options]
+
+FASTDUP=${1:?usage: $0 path/to/fastdup [options]}
+shift
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/fastdup-test.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/files"
+F="$DIR/files"
+head -c 10000 /dev/urandom > "$F/plain" || exit 1
+for name in 'q"uote' 'back\slash' "$(printf 'new\nline')" "$(printf 'tab\t')" "$(printf 'utf-\303\251')" \
+            "$(printf 'bad-\377')"; do
+	cp "$F/plain" "$F/$name" || exit 1
+done
+head -c 20000 /dev/urandom > "$F/x"
+cp "$F/x" "$F/y"
+ln "$F/x" "$F/z"
+
+status=0
+result()
+{
+	if [ "$2" = 1 ]; then
+		echo "PASS output-formats ($1)"
+	else
+		status=1
+	fi
+}
+
+ok=1
+json=$("$FASTDUP" --json "$@" "$F" 2>/dev/null)
+if [ "$(printf '%s\n' "$json" | grep -c '^{"size":[0-9]*,"linked":\(true\|false\),"files":\[.*\]}$')" != 3 ]; then
+	echo "FAIL output-formats (--json): expected 3 sets, one per line"
+	ok=0
+fi
+for want in '"linked":true' "\"$F/q\\\"uote\"" "\"$F/back\\\\slash\"" "\"$F/new\\u000aline\"" "\"$F/tab\\u0009\"" \
+            "$(printf '"%s/utf-\303\251"' "$F")" "\"$F/bad-\\udcff\""; do
+	if ! printf '%s\n' "$json" | grep -qF "$want"; then
+		echo "FAIL output-formats (--json): no $want"
+		ok=0
+	fi
+done
+result --json $ok
+
+# Each path on a line of its own, with newlines in paths shown as #, and an
+# empty line at the end of each set
+ok=1
+got=$("$FASTDUP" -0 "$@" "$F" 2>/dev/null | tr '\n\000' '#\n' | sort)
+expect=$(printf '%s\n' "" "" "$F/bad-$(printf '\377')" "$F/back\\slash" "$F/new#line" "$F/plain" "$F/q\"uote" \
+         "$F/tab$(printf '\t')" "$F/utf-$(printf '\303\251')" "$F/x" "$F/y" | sort)
+if [ "$got" != "$expect" ]; then
+	echo "FAIL output-formats (-0): paths differ"
+	ok=0
+fi
+result -0 $ok
+exit $status